@@ -1,6 +1,24 @@
 /* Cosmetic configuration */
 #define TABWIDTH 8
 
+/* Milliseconds to wait for a burst of terminal resizes to settle */
+#define RESIZEDELAY 50
+
+/* Milliseconds between updates of the count of matches while counting */
+#define STATUSDELAY 100
+
+/* Number of layouts for other terminal widths to keep for switching back */
+#define LAYOUTCACHE 3
+
+/* Attributes flipped on matches of the last search */
+#define MATCHATTR ATTR_REVERSE
+
+/*
+ * Colours of highlighted keywords, in the order they are added, as numbers
+ * from the terminal's 256-colour palette (1 is red, 3 yellow, and so on)
+ */
+static const int keywordcolours[] = { 1, 3, 2, 6, 5, 4 };
+
 /*
  * Keybindings are defined in the following format:
  * { key, function, argument }
@@ -13,13 +31,20 @@
  * For reference, here is a list of the functions provided:
  * pagedown(lf) - scroll down by lf screens
  * pageup(lf) - scroll up by lf screens
- * promptsearch(dir) - prompt for a search string
+ * promptfilter() - prompt for a pattern to show only the lines matching
+ * promptkeyword() - prompt for a string to highlight wherever it appears
+ * promptsearch(dir) - prompt for a search string or regular expression
+ * redraw() - draw the whole screen again
  * scrolldown(zu) - scroll down by zu lines
+ * scrollleft(lf) - scroll left by lf screen widths when lines are chopped
+ * scrollright(lf) - scroll right by lf screen widths when lines are chopped
  * scrollup(zu) - scroll up by zu lines
  * scrolltop() - scroll to the top of the document
  * scrollbot() - scroll to the bottom of the document
  * searchbackwards() - find the previous occurrence of the search string
  * searchforwards() - find the next occurrence of the search string
+ * togglechop() - switch between wrapping and chopping long lines
+ * togglehex() - switch between the text and hex dump views
  * quit() - exit spg
  */
 static Key keys[] = {
@@ -35,5 +60,12 @@ static Key keys[] = {
 	{ '?', promptsearch, { .dir = BACKWARDS } },
 	{ 'n', searchforwards, { 0 } },
 	{ 'N', searchbackwards, { 0 } },
+	{ '&', promptfilter, { 0 } },
+	{ '*', promptkeyword, { 0 } },
+	{ 'h', scrollleft, { .lf = 0.5 } },
+	{ 'l', scrollright, { .lf = 0.5 } },
+	{ 'S', togglechop, { 0 } },
+	{ 'x', togglehex, { 0 } },
+	{ '\f', redraw, { 0 } },
 	{ 'q', quit, { 0 } },
 };
@@ -2,4 +2,4 @@ PREFIX = /usr/local
 MANDIR = $(PREFIX)/share/man/man1
 
 CFLAGS = -O0 -g
-LIBS = -lcurses
+LIBS = -lcurses -lpthread
@@ -16,6 +16,10 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -24,21 +28,48 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include <term.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SIMD
+#endif
+
 /* This is coming from term.h and it conflicts with one of our names */
 #undef lines
 
 #define LEN(x) (sizeof(x) / sizeof(*(x)))
+#define MAX(x, y) ((x) < (y) ? (y) : (x))
 #define MIN(x, y) ((x) > (y) ? (y) : (x))
 #define USED(x) ((void)(x))
 
+/* Whether a string capability from term.h is there to be used */
+#define HASCAP(s) ((s) && (s) != (char *)-1)
+
+/* Number of keys the trigrams of the text are hashed to by the index */
+#define IDXKEYS (1 << 16)
+
+/* Size of the chunks large spans of text are split into at line starts */
+#define CHUNKSIZE (1 << 20)
+
+/* Colours are stored plus one, so that zero means the terminal's default */
+#define ATTR_FG(a) ((a) & 0x1FF)
+#define ATTR_BG(a) ((a) >> 9 & 0x1FF)
+#define ATTR_SETFG(a, c) (((a) & ~(Attr)0x1FF) | (c))
+#define ATTR_SETBG(a, c) (((a) & ~((Attr)0x1FF << 9)) | (Attr)(c) << 9)
+
 enum {
 	KEY_BACKSPACE = '\x7F',
 	KEY_ESCAPE = '\x1B',
 	KEY_RESIZE = -2,
+	KEY_WAKE = -3,
+	KEY_IDLE = -4,
 	KEY_RETURN = '\n',
 };
 
@@ -48,14 +79,39 @@ enum {
 	RUNE_INVALID = 0xFFFD,
 };
 
+enum {
+	ATTR_BOLD = 1 << 18,
+	ATTR_DIM = 1 << 19,
+	ATTR_ITALIC = 1 << 20,
+	ATTR_UNDERLINE = 1 << 21,
+	ATTR_BLINK = 1 << 22,
+	ATTR_REVERSE = 1 << 23,
+	ATTR_STANDOUT = 1 << 24, /* Standout mode, for control characters */
+};
+
 enum Direction {
 	FORWARDS,
 	BACKWARDS,
 };
 
+enum Encoding {
+	ENC_UTF8,
+	ENC_UTF16LE,
+	ENC_UTF16BE,
+	ENC_LATIN1,
+};
+
+enum Case {
+	CASE_EXACT,
+	CASE_SMART, /* Ignore case unless the pattern has capitals */
+	CASE_IGNORE,
+};
+
 typedef union Arg Arg;
 typedef struct Key Key;
 typedef enum Direction Direction;
+typedef enum Encoding Encoding;
+typedef enum Case Case;
 
 union Arg {
 	size_t zu;
@@ -69,51 +125,346 @@ struct Key {
 	Arg arg;
 };
 
+static int filtersubmit(Arg a);
+static int keywordsubmit(Arg a);
 static int pagedown(Arg a);
 static int pageup(Arg a);
+static int promptfilter(Arg a);
+static int promptkeyword(Arg a);
 static int promptsearch(Arg a);
+static int redraw(Arg a);
 static int scrollbot(Arg a);
 static int scrolldown(Arg a);
+static int scrollleft(Arg a);
+static int scrollright(Arg a);
 static int scrolltop(Arg a);
 static int scrollup(Arg a);
 static int searchbackwards(Arg a);
 static int searchforwards(Arg a);
+static int searchsubmit(Arg a);
+static int searchupdate(Arg a);
+static int togglechop(Arg a);
+static int togglehex(Arg a);
 static int quit(Arg a);
 
 #include "config.h"
 
 typedef int_fast32_t Rune;
+typedef uint_least32_t Attr;
+typedef struct Run Run;
 typedef struct Buffer Buffer;
+typedef struct Layout Layout;
 typedef struct Window Window;
 typedef struct Input Input;
 typedef struct Prompt Prompt;
+typedef struct Task Task;
+typedef struct Chunk Chunk;
+typedef struct Pair Pair;
+typedef struct Pattern Pattern;
+typedef struct Search Search;
+typedef struct Hits Hits;
+typedef struct Filter Filter;
+typedef struct Block Block;
+typedef struct Posting Posting;
+typedef struct Index Index;
+typedef struct Candidates Candidates;
+typedef struct Keywords Keywords;
+typedef struct Cell Cell;
+typedef struct Screen Screen;
 
 static Window *win;
 static Input *input;
 static Prompt *search;
-
+static Prompt *filterprompt;
+static Prompt *keywordprompt;
+static Search *srch;
+static Index *textindex;
+static Keywords *keywords;
+static Direction searchdir;
+static size_t searchorigin;
+
+static Screen screen;
 static struct termios tsave;
 static struct termios tcurr;
 static FILE *tty;
+static sigset_t waitmask;
 static sig_atomic_t winch;
+static int wakefd[2] = { -1, -1 };
+static int status; /* Whether the last row shows the count of matches */
+static int chop;
+static int rawcolour;
+static int indexing;
+static Case casemode;
+
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pooldone = PTHREAD_COND_INITIALIZER;
+static Task *poolhead, **pooltail = &poolhead;
+static size_t nworkers = SIZE_MAX;
+
+/*
+ * Vectorised search prefilters, chosen by scaninit for the CPU at hand. They
+ * are left null where there is no vector unit to use.
+ */
+static size_t (*scanpair)(const char *s, size_t n, const Pair *p);
+static size_t (*rscanpair)(const char *s, size_t n, const Pair *p);
 
+/* An attribute change at offset pos of the text */
+struct Run {
+	size_t pos;
+	Attr attr;
+};
+
+/*
+ * The text read so far, normalised to UTF-8, along with its attributes. The
+ * text is only ever appended to, so offsets into it stay valid. Worker threads
+ * may read the text while the main thread appends to it; they hold lock for
+ * reading meanwhile, so that the text can't move under them.
+ */
 struct Buffer {
-	Rune **lines;
-	size_t len, cap, linecap;
+	char *text;
+	Run *runs;
+	size_t textlen, textcap, nruns, runscap;
+	pthread_rwlock_t lock;
+};
+
+/*
+ * The display rows of a buffer at some width, stored as the offsets of the
+ * text where they start. The rows cover the text between rows[0] and end
+ * without gaps, but need not start at the beginning of the text: a layout is
+ * extended in either direction as needed. Rows live in the middle of mem, so
+ * that there is room to add rows at both ends.
+ */
+struct Layout {
+	size_t *mem, *rows;
+	size_t len, cap, end, width;
 };
 
+/*
+ * The position of a window is kept twice: as the row after the last one on
+ * screen, and as the offset of the text at the top of the screen. The offset
+ * doesn't depend on the width, so it is what a resize goes by. Layouts for
+ * the widths used most recently before the current one are kept in cache,
+ * most recent first.
+ */
 struct Window {
 	Buffer *buf;
-	size_t rows, cols, row;
+	Layout *lay;
+	Layout *cache[LAYOUTCACHE];
+	size_t rows, cols, row, anchor;
+	size_t hoff; /* Columns scrolled to the right when lines are chopped */
+	int hex;
+	off_t hexoff;
+	Filter *filter; /* The lines shown instead of all of them, if any */
 };
 
 struct Input {
 	FILE *file;
-	char buf[4];
-	size_t buflen;
-	Rune unread;
+	FILE *spool; /* Copy of non-seekable input, for random access */
+	off_t base, pos, spoollen;
+	int seekable, binary, spooleof;
+	Encoding enc;
+	char raw[BUFSIZ]; /* Bytes read but not yet transcoded */
+	char buf[2 * BUFSIZ + 4]; /* UTF-8 text awaiting decoding */
+	size_t rawlen, buflen, bufpos;
+	int eof;
+	Attr attr;
+};
+
+/*
+ * A unit of work for the worker threads. When the task has finished, the
+ * counter pointed to by pending (if any) is decremented.
+ */
+struct Task {
+	void (*func)(void *);
+	void *arg;
+	size_t *pending;
+	Task *next;
+};
+
+/* A span of the text laid out by one worker, and the rows that came of it */
+struct Chunk {
+	Buffer *buf;
+	size_t from, to, width;
+	size_t *rows, len, cap;
+};
+
+/*
+ * Two bytes d apart that every match of a string has, the first at offset at
+ * of the match. A byte of the text stands for a if it equals a once or'ed with
+ * ma, and likewise for b, which lets ASCII letters match in either case. at is
+ * SIZE_MAX if there are no such bytes.
+ */
+struct Pair {
+	unsigned char a, b, ma, mb;
+	size_t at, d;
+};
+
+/*
+ * A string to search for, along with the Horspool skip tables for both
+ * directions: skip is indexed by the byte under the end of the needle when
+ * going forwards, and rskip by the byte under its start when going backwards.
+ * If the search is for a regular expression, the string is a part of it that
+ * every match must contain (possibly empty), so that lines without it can be
+ * skipped. When case is ignored, fs is the string with its case folded, and
+ * the skip tables go unused.
+ */
+struct Pattern {
+	char *src;
+	char *s, *fs;
+	size_t len;
+	Pair pair;
+	size_t skip[256], rskip[256];
+	int isregex, icase;
+	regex_t re;
+};
+
+/*
+ * The blocks of the index that might hold a match of a pattern, kept up to
+ * date as the index grows. count has how many of the pattern's keys each of
+ * the first len blocks has; the posting list of keys[i] has been read up to
+ * byte pos[i], where the block numbers carry on from next[i]. nkeys is
+ * SIZE_MAX until the keys have been picked.
+ */
+struct Candidates {
+	unsigned *keys;
+	size_t nkeys, *pos, *next;
+	unsigned char *count;
+	size_t len;
+};
+
+/*
+ * A search over the whole text, carried out in the background by the worker
+ * threads. The text up to end is split into chunks at line starts, and the
+ * offsets of all matches in each chunk are collected by a task of its own.
+ * The chunks are in order of offset, but are searched nearest the point the
+ * search was started from first.
+ */
+struct Search {
+	Buffer *buf;
+	Pattern *pat;
+	Hits **hits;
+	size_t len, cap, end;
+	size_t cur; /* The match last moved to, or SIZE_MAX */
+	size_t near; /* Where matches are looked at, protected by poollock */
+	int keep; /* Whether chunks keep their matches wherever they are */
+	Candidates cand;
+	int stop; /* Protected by poollock */
+};
+
+/*
+ * The matches starting between from and to, once pending drops to zero. The
+ * ends of the matches are only kept for a regular expression; otherwise they
+ * all have the length of the string searched for. When a search narrows down
+ * another, its matches are picked out of those the other had found. A chunk
+ * far from where the search is looked at only keeps the count of its matches,
+ * leaving offs NULL, and is searched again when they are needed.
+ */
+struct Hits {
+	Search *srch;
+	size_t from, to;
+	size_t *offs, *ends, len, cap;
+	size_t pending;
+	Task task;
+};
+
+/*
+ * The lines holding matches of a search, stored as the offsets where they
+ * start. Lines are picked out of the chunks of the search in order, as far as
+ * they are needed. While a window shows only these lines, top is the index of
+ * the one on top of the screen, and the anchor of the window is the start of
+ * the top row within it.
+ */
+struct Filter {
+	Search *srch;
+	size_t *lines, len, cap;
+	size_t next; /* The chunk of the search to pick lines out of next */
+	size_t top;
+	int (*stop)(void); /* Says when to stop looking for more lines */
+};
+
+/*
+ * A stretch of the text between line starts, and the sorted keys of the
+ * trigrams in it, once pending drops to zero. The keys are dropped once they
+ * have been added to the posting lists of the index.
+ */
+struct Block {
+	Buffer *buf;
+	size_t from, to;
+	uint16_t *keys;
+	size_t nkeys;
+	size_t pending;
+	Task task;
+};
+
+/*
+ * The numbers of the blocks with a trigram of some key, each stored as its
+ * difference from the one before in LEB128 form, so that runs of blocks take
+ * a byte apiece. next is one past the number of the last block.
+ */
+struct Posting {
+	unsigned char *data;
+	size_t len, cap, next;
+};
+
+/*
+ * An index of the trigrams of the text, built in the background as it is
+ * read, so that a search can pass over blocks that can't hold a match.
+ * Trigrams are hashed to a key with ASCII letters folded to lower case, so a
+ * block may be looked at needlessly but is never passed over wrongly. The
+ * blocks up to merged have been added to the posting lists, in order.
+ */
+struct Index {
+	Buffer *buf;
+	Block **blocks;
+	size_t len, cap, end, merged;
+	Posting post[IDXKEYS];
+};
+
+/*
+ * Strings to highlight wherever they are, each in a colour of its own. They
+ * are found with an Aho-Corasick automaton, whose transitions for every byte
+ * from every state are filled in, so that the text is scanned a byte at a
+ * time with no backtracking. A state's output is the longest string that
+ * ends there, plus one, or zero if none does. The strings found in the rows
+ * drawn recently are kept in cache, indexed by a hash of where the row starts.
+ */
+struct Keywords {
+	char **words;
+	size_t *lens, len, maxlen;
+	uint32_t (*next)[256];
+	uint32_t *out;
+	size_t nstates;
+	struct {
+		size_t from, to;
+		size_t *spans, n;
+	} cache[256];
+};
+
+/* A character cell of the screen */
+struct Cell {
+	Rune r;
+	Attr attr;
+};
+
+/*
+ * The screen as it is to be, and as it was last written out to the terminal.
+ * Drawing only changes frame, at row y and column x with attributes attr;
+ * uiflush then writes out the cells that differ from those shown. Until valid
+ * is set, the terminal is cleared first and shown is taken to be blank. What
+ * is to be written is gathered in out, so that it goes out in one write.
+ * fastgoto is set when cursor_address is the ANSI sequence of sprintgoto.
+ */
+struct Screen {
+	Cell *frame, *shown;
+	size_t rows, cols, y, x;
+	Attr attr;
+	int valid, fastgoto;
+	char *out;
+	size_t outlen, outcap;
 };
 
+/* A line of input; action is run when it is entered, update as it is edited */
 struct Prompt {
 	Rune *text;
 	char buf[4];
@@ -121,64 +472,245 @@ struct Prompt {
 	int active;
 	Rune prompt;
 	int (*action)(Arg);
+	int (*update)(Arg);
 };
 
 static void die(int status, const char *fmt, ...);
 static void *xmalloc(size_t sz);
 static void *xrealloc(void *mem, size_t sz);
 
-static size_t linelen(const Rune *r);
+static void poolinit(void);
+static int poolqueued(void);
+static void poolrun(Task *t);
+static int poolstep(void);
+static void poolsubmit(Task *t);
+static void poolwait(size_t *pending);
+static void *poolworker(void *arg);
+
+static int foldcmp(const char *s, const char *f, size_t len);
+static Rune foldrune(Rune r);
+static size_t hexrowlen(size_t cols);
 static size_t nexttabstop(size_t col);
 static size_t printwidth(Rune r);
+static size_t sprintcount(char *s, size_t n);
+static size_t sprintgoto(char *s, size_t y, size_t x);
 static size_t sprintrune(char *s, Rune r);
 static size_t utfdecode(const char *s, size_t len, Rune *r);
 static size_t utfencode(char *s, Rune r);
 static size_t utfpeeklen(char c);
-
-static Buffer *bufnew(size_t width);
+static Encoding sniffencoding(const char *s, size_t len, size_t *bomlen);
+static size_t latin1toutf8(char *dst, const char *src, size_t len);
+static size_t utf16toutf8(char *dst, const char *src, size_t len, int be, size_t *used);
+static Attr sgrapply(Attr a, const int *params, size_t nparams);
+static size_t sgrdiff(char *s, Attr from, Attr to);
+static void scaninit(void);
+static size_t scanpairbytes(const char *s, size_t n, const Pair *p);
+static size_t rscanpairbytes(const char *s, size_t n, const Pair *p);
+#ifdef HAVE_SIMD
+static size_t scanpairsse2(const char *s, size_t n, const Pair *p);
+static size_t scanpairavx2(const char *s, size_t n, const Pair *p);
+static size_t rscanpairsse2(const char *s, size_t n, const Pair *p);
+static size_t rscanpairavx2(const char *s, size_t n, const Pair *p);
+#endif
+
+static Buffer *bufnew(void);
 static void buffree(Buffer *buf);
-static void bufgrow(Buffer *buf);
-static int buflookingat(Buffer *buf, const Rune *s, size_t len, size_t row, size_t col);
-static Rune *bufnewline(Buffer *buf);
-static Buffer *bufreflow(Buffer *buf, size_t width, size_t row, size_t *newrow);
-static int bufsearchbackwards(Buffer *buf, const Rune *s, size_t len, size_t row, size_t *found);
-static int bufsearchforwards(Buffer *buf, const Rune *s, size_t len, size_t row, size_t *found);
+static Attr bufattr(Buffer *buf, size_t off, size_t *next);
+static size_t bufcolumn(Buffer *buf, size_t off);
+static int buffindbackwards(Buffer *buf, const Pattern *pat, size_t off, size_t *found);
+static int buffindforwards(Buffer *buf, const Pattern *pat, size_t off, size_t end, size_t *found);
+static size_t *buflayout(Buffer *buf, size_t from, size_t to, size_t width, size_t *len);
+static void buflayoutchunk(void *arg);
+static size_t buflineend(Buffer *buf, size_t off);
+static size_t buflinestart(Buffer *buf, size_t off);
+static int bufmatchlast(Buffer *buf, const Pattern *pat, size_t from, size_t to, size_t before, size_t *found);
+static int bufread(Buffer *buf, Input *in);
+static size_t bufrowend(Buffer *buf, size_t off, size_t width, int final);
+static int bufsearchbackwards(Buffer *buf, const Pattern *pat, size_t off, size_t *found);
+static int bufsearchforwards(Buffer *buf, const Pattern *pat, size_t off, size_t end, size_t *found, size_t *foundend);
+
+static Layout *laynew(size_t width, size_t start);
+static void layfree(Layout *lay);
+static void layreserve(Layout *lay, size_t front, size_t back);
+static size_t layfind(Layout *lay, size_t off);
+static size_t layrowend(Layout *lay, size_t row);
+static size_t laystart(Layout *lay);
+
+static Index *idxnew(Buffer *buf);
+static void idxfree(Index *x);
+static void idxblock(void *arg);
+static size_t idxcandidates(Index *x, const Pattern *pat, Candidates *c);
+static void idxextend(Index *x, int final);
+static size_t idxfind(Index *x, size_t off);
+static unsigned idxfold(char c);
+static unsigned idxkey(uint32_t t);
+static void idxmerge(Index *x);
+
+static Keywords *kwnew(void);
+static void kwfree(Keywords *kw);
+static void kwadd(Keywords *kw, char *s, size_t len);
+static void kwbuild(Keywords *kw);
+static size_t kwspans(Keywords *kw, Buffer *buf, size_t from, size_t to, size_t **spans);
+
+static Pattern *patnew(char *s, size_t len, Case mode);
+static void patfree(Pattern *pat);
+static int patcompile(Pattern *pat);
+static int patequal(const Pattern *pat, const char *t);
+static int patmatch(const Pattern *pat, const char *text, size_t from, size_t to, size_t *start, size_t *end);
+static size_t patrequired(const char *re, char **lit);
+
+static void hitsdone(Hits *h);
+static void hitsdrop(Hits *h);
+static size_t hitsfind(const Hits *h, size_t off);
+static void hitsload(Hits *h);
+static void hitsscan(Hits *h);
+
+static Search *srchnew(Buffer *buf, Pattern *pat);
+static void srchfree(Search *s);
+static int srchbackwards(Search *s, size_t off, size_t *found);
+static void srchchunk(void *arg);
+static int srchcount(Search *s, size_t off, size_t *total, size_t *nth);
+static void srchextend(Search *s, int final, size_t near);
+static size_t srchfind(Search *s, size_t off);
+static int srchforwards(Search *s, size_t off, int final, size_t *found);
+static Search *srchnarrow(Search *prev, Pattern *pat);
+static void srchnarrowchunk(void *arg);
+static size_t srchend(Search *s, size_t off);
+static size_t srchspans(Search *s, size_t from, size_t to, size_t **spans);
+static Search *srchupdate(Search *s, Buffer *buf, Prompt *p);
+static void srchsubmit(Search *s, size_t first, size_t near);
+
+static Filter *filtnew(Search *s, int (*stop)(void));
+static void filtfree(Filter *f);
 
 static Window *winnew(size_t rows, size_t cols);
 static void winfree(Window *win);
-static void winfill(Window *win, Input *in);
+static void winappend(Window *win, size_t to);
+static void winfilter(Window *win, Filter *f, Input *in);
+static int winfilterdown(Window *win, size_t *line, size_t *pos, Input *in);
+static int winfilterfill(Window *win, size_t n, Input *in);
+static size_t winfilterfind(Window *win, size_t off, Input *in);
+static void winfilterrow(Window *win, size_t line, size_t off);
+static int winfilterup(Window *win, size_t *line, size_t *pos);
 static int wingetline(Window *win, Input *in);
+static void winhexseek(Window *win, off_t off, Input *in);
+static size_t winprepend(Window *win, size_t rows);
+static int winreadahead(Window *win, Input *in, size_t *ahead, int (*stop)(void));
+static size_t winrows(Window *win, size_t **rows, Input *in);
 static void winresize(Window *win, size_t rows, size_t cols, Input *in);
+static void winreveal(Window *win, size_t from, size_t to);
 static void winscrollbot(Window *win, Input *in);
 static void winscrolldown(Window *win, size_t lines, Input *in);
-static void winscrolltop(Window *win);
-static void winscrollup(Window *win, size_t lines);
-static void winsearchbackwards(Window *win, const Rune *s, size_t len);
-static void winsearchforwards(Window *win, const Rune *s, size_t len, Input *in);
+static void winscrollleft(Window *win, size_t cols);
+static void winscrollright(Window *win, size_t cols);
+static void winscrolltop(Window *win, Input *in);
+static void winscrollup(Window *win, size_t lines, Input *in);
+static void winsearchbackwards(Window *win, Search *s, Input *in);
+static void winsearchforwards(Window *win, Search *s, Input *in, int (*stop)(void));
+static void winseek(Window *win, size_t off, Input *in);
+static void winsetanchor(Window *win);
+static void winsetwidth(Window *win, size_t width);
 
 static Input *inputnew(FILE *file);
 static void inputfree(Input *in);
 static int inputatend(Input *in);
+static int inputfill(Input *in);
+static ssize_t inputpull(Input *in);
+static ssize_t inputread(Input *in, char *buf, size_t len);
+static size_t inputreadat(Input *in, off_t off, char *buf, size_t len);
+static off_t inputsize(Input *in);
+static int inputbuffered(Input *in);
+static int inputready(Input *in);
+static Rune inputdecode(Input *in);
 static Rune inputgetrune(Input *in);
-static void inputungetrune(Input *in, Rune r);
 
 static Prompt *promptnew(Rune prompt, int (*action)(Arg));
 static void promptfree(Prompt *p);
 static Rune promptputchar(Prompt *p, char c);
+static char *promptutf8(Prompt *p, size_t *len);
 
 static void uiinit(void);
 static void uiteardown(void);
-static int uigetkey(void);
+static void uierase(size_t row);
+static void uiflush(void);
+static int uigetkey(int idle);
 static void uigetsize(size_t *rows, size_t *cols);
+static void uigoto(size_t y, size_t x);
+static int uikeypending(void);
+static void uimove(size_t y, size_t x);
+static void uiout(const char *s, size_t n);
+static int uioutc(int c);
 static size_t uiprint(Rune r, size_t col);
+static void uipromptdraw(Prompt *p);
 static void uipromptkey(Prompt *p, char key);
 static void uipromptopen(Prompt *p);
+static Prompt *uiprompt(void);
+static void uiput(Rune r);
+static void uiputp(const char *cap);
+static void uiputs(const char *s);
 static void uirefresh(void);
+static void uirepeat(const char *parm, const char *one, size_t n);
+static void uirefreshhex(void);
+static int uirowsame(size_t a, size_t b);
+static void uisetattr(Attr from, Attr to);
 static void uiresize(void);
+static void uireadahead(void);
+static void uiscroll(void);
+static void uisetsize(size_t rows, size_t cols);
+static void uisetstatus(int on);
+static void uistatus(char *s);
+static void uistatusdraw(void);
+static void uiwake(void);
+static void uiwrite(void);
 
 static void sigterm(int signo);
 static void sigwinch(int signo);
 
+/* Shows only the lines matching the filter prompt, or all of them if it's empty */
+static int
+filtersubmit(Arg a)
+{
+	Filter *f;
+	char *s;
+	size_t len;
+
+	USED(a);
+	if (win->hex)
+		return 0;
+	f = NULL;
+	s = promptutf8(filterprompt, &len);
+	if (len > 0)
+		f = filtnew(srchnew(win->buf, patnew(s, len, casemode)), uikeypending);
+	else
+		free(s);
+	winfilter(win, f, input);
+	uirefresh();
+	return 0;
+}
+
+/* Highlights the text of the keyword prompt, or nothing if it's empty */
+static int
+keywordsubmit(Arg a)
+{
+	char *s;
+	size_t len;
+
+	USED(a);
+	s = promptutf8(keywordprompt, &len);
+	if (len == 0) {
+		free(s);
+		if (keywords)
+			kwfree(keywords);
+		keywords = NULL;
+	} else {
+		if (!keywords)
+			keywords = kwnew();
+		kwadd(keywords, s, len);
+	}
+	uirefresh();
+	return 0;
+}
+
 static int
 pagedown(Arg a)
 {
@@ -190,21 +722,35 @@ pagedown(Arg a)
 static int
 pageup(Arg a)
 {
-	winscrollup(win, a.lf > 0 ? a.lf * win->rows : 1);
+	winscrollup(win, a.lf > 0 ? a.lf * win->rows : 1, input);
 	uirefresh();
 	return 0;
 }
 
+static int
+promptfilter(Arg a)
+{
+	USED(a);
+	uipromptopen(filterprompt);
+	return 0;
+}
+
+static int
+promptkeyword(Arg a)
+{
+	USED(a);
+	uipromptopen(keywordprompt);
+	return 0;
+}
+
 static int
 promptsearch(Arg a)
 {
-	if (a.dir == FORWARDS) {
-		search->prompt = '/';
-		search->action = searchforwards;
-	} else {
-		search->prompt = '?';
-		search->action = searchbackwards;
-	}
+	search->prompt = a.dir == FORWARDS ? '/' : '?';
+	search->action = searchsubmit;
+	search->update = searchupdate;
+	searchdir = a.dir;
+	searchorigin = win->anchor;
 	uipromptopen(search);
 	return 0;
 }
@@ -226,11 +772,27 @@ scrolldown(Arg a)
 	return 0;
 }
 
+static int
+scrollleft(Arg a)
+{
+	winscrollleft(win, a.lf > 0 ? a.lf * win->cols : 1);
+	uirefresh();
+	return 0;
+}
+
+static int
+scrollright(Arg a)
+{
+	winscrollright(win, a.lf > 0 ? a.lf * win->cols : 1);
+	uirefresh();
+	return 0;
+}
+
 static int
 scrolltop(Arg a)
 {
 	USED(a);
-	winscrolltop(win);
+	winscrolltop(win, input);
 	uirefresh();
 	return 0;
 }
@@ -238,7 +800,7 @@ scrolltop(Arg a)
 static int
 scrollup(Arg a)
 {
-	winscrollup(win, a.zu);
+	winscrollup(win, a.zu, input);
 	uirefresh();
 	return 0;
 }
@@ -247,7 +809,11 @@ static int
 searchbackwards(Arg a)
 {
 	USED(a);
-	winsearchbackwards(win, search->text, search->len);
+	if (win->hex)
+		return 0;
+	uisetstatus(1);
+	srch = srchupdate(srch, win->buf, search);
+	winsearchbackwards(win, srch, input);
 	uirefresh();
 	return 0;
 }
@@ -256,7 +822,83 @@ static int
 searchforwards(Arg a)
 {
 	USED(a);
-	winsearchforwards(win, search->text, search->len, input);
+	if (win->hex)
+		return 0;
+	uisetstatus(1);
+	srch = srchupdate(srch, win->buf, search);
+	winsearchforwards(win, srch, input, NULL);
+	uirefresh();
+	return 0;
+}
+
+/* Runs a search from where the window was when the prompt was opened */
+static int
+searchsubmit(Arg a)
+{
+	if (!win->hex)
+		winseek(win, searchorigin, input);
+	return searchdir == FORWARDS ? searchforwards(a) : searchbackwards(a);
+}
+
+/*
+ * Moves to the first match of the search prompt as it is typed. Only as much
+ * input is read as can be before the next key arrives.
+ */
+static int
+searchupdate(Arg a)
+{
+	USED(a);
+	if (!win->hex) {
+		winseek(win, searchorigin, input);
+		if (search->len == 0) {
+			if (srch)
+				srchfree(srch);
+			srch = NULL;
+		} else {
+			srch = srchupdate(srch, win->buf, search);
+			if (searchdir == FORWARDS)
+				winsearchforwards(win, srch, input, uikeypending);
+			else
+				winsearchbackwards(win, srch, input);
+		}
+		/* A forward match is on the bottom row, which the prompt covers */
+		if (search->active && searchdir == FORWARDS && win->anchor != searchorigin)
+			winscrolldown(win, 1, input);
+	}
+	if (uikeypending())
+		return 0;
+	uirefresh();
+	return 0;
+}
+
+static int
+togglechop(Arg a)
+{
+	USED(a);
+	chop = !chop;
+	win->hoff = 0;
+	winresize(win, win->rows, win->cols, input);
+	uirefresh();
+	return 0;
+}
+
+static int
+togglehex(Arg a)
+{
+	USED(a);
+	if (!input->seekable && !input->spool)
+		return 0; /* The bytes already read as text are gone */
+	win->hex = !win->hex;
+	uirefresh();
+	return 0;
+}
+
+/* Draws the whole screen again, in case something else has written to it */
+static int
+redraw(Arg a)
+{
+	USED(a);
+	screen.valid = 0;
 	uirefresh();
 	return 0;
 }
@@ -305,15 +947,233 @@ xrealloc(void *mem, size_t sz)
 	return newmem;
 }
 
+static void
+poolinit(void)
+{
+	pthread_t thread;
+	sigset_t all, old;
+	long ncpu;
+	size_t i;
+
+	/* The calling thread helps out while it waits, so it counts as one */
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nworkers = ncpu > 1 ? MIN((size_t)ncpu - 1, 63) : 0;
+
+	/* Signals are for the main thread to handle */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&thread, NULL, poolworker, NULL) || pthread_detach(thread))
+			die(1, "pthread_create");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Reports whether there are tasks waiting for a thread to run them */
+static int
+poolqueued(void)
+{
+	int queued;
+
+	pthread_mutex_lock(&poollock);
+	queued = poolhead != NULL;
+	pthread_mutex_unlock(&poollock);
+	return queued;
+}
+
+/*
+ * Runs a task taken off the queue, letting go of poollock (which the caller
+ * holds) meanwhile. The main thread is woken up to show the progress made.
+ */
+static void
+poolrun(Task *t)
+{
+	pthread_mutex_unlock(&poollock);
+	t->func(t->arg);
+	pthread_mutex_lock(&poollock);
+	if (t->pending && --*t->pending == 0) {
+		pthread_cond_broadcast(&pooldone);
+		uiwake();
+	}
+}
+
+/*
+ * Runs the next task on the queue on the calling thread, if there is one.
+ * Returns whether there was.
+ */
+static int
+poolstep(void)
+{
+	Task *t;
+
+	pthread_mutex_lock(&poollock);
+	if ((t = poolhead)) {
+		if (!(poolhead = t->next))
+			pooltail = &poolhead;
+		poolrun(t);
+	}
+	pthread_mutex_unlock(&poollock);
+	return t != NULL;
+}
+
+static void
+poolsubmit(Task *t)
+{
+	if (nworkers == SIZE_MAX)
+		poolinit();
+
+	pthread_mutex_lock(&poollock);
+	t->next = NULL;
+	*pooltail = t;
+	pooltail = &t->next;
+	pthread_cond_signal(&poolwork);
+	pthread_mutex_unlock(&poollock);
+}
+
+/*
+ * Waits until the tasks counted by pending have finished, running any of them
+ * that no worker has picked up yet.
+ */
+static void
+poolwait(size_t *pending)
+{
+	Task **tp, *t;
+
+	pthread_mutex_lock(&poollock);
+	while (*pending > 0) {
+		for (tp = &poolhead; *tp && (*tp)->pending != pending; tp = &(*tp)->next)
+			;
+		if (!(t = *tp)) {
+			pthread_cond_wait(&pooldone, &poollock);
+			continue;
+		}
+
+		if (!(*tp = t->next))
+			pooltail = tp;
+		pthread_mutex_unlock(&poollock);
+		t->func(t->arg);
+		pthread_mutex_lock(&poollock);
+		--*pending;
+	}
+	pthread_mutex_unlock(&poollock);
+}
+
+static void *
+poolworker(void *arg)
+{
+	Task *t;
+
+	USED(arg);
+	pthread_mutex_lock(&poollock);
+	for (;;) {
+		while (!poolhead)
+			pthread_cond_wait(&poolwork, &poollock);
+		t = poolhead;
+		if (!(poolhead = t->next))
+			pooltail = &poolhead;
+		poolrun(t);
+	}
+	return NULL;
+}
+
+/*
+ * Compares len bytes of s with f, which has its case folded already, folding
+ * the case of s as it goes. Eight bytes are compared at a time while they are
+ * all ASCII, turning the capitals among them into small letters at once: a
+ * byte is a capital if adding 0x3F carries into its top bit but adding 0x25
+ * doesn't.
+ */
+static int
+foldcmp(const char *s, const char *f, size_t len)
+{
+	const uint64_t ones = 0x0101010101010101, high = 0x80 * ones;
+	uint64_t x, y, upper;
+	Rune r, g;
+	size_t i, n;
+
+	for (i = 0; i < len; i += n) {
+		if (len - i >= 8) {
+			memcpy(&x, s + i, 8);
+			memcpy(&y, f + i, 8);
+			if (!(x & high)) {
+				upper = (x + 0x3F * ones) & ~(x + 0x25 * ones) & high;
+				if ((x | upper >> 2) != y)
+					return 1;
+				n = 8;
+				continue;
+			}
+		}
+		n = utfdecode(s + i, len - i, &r);
+		utfdecode(f + i, len - i, &g);
+		if (foldrune(r) != g)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Folds the case of a rune, following Unicode's simple case folding for the
+ * scripts in common use. Folds that would change how long a rune is in UTF-8,
+ * like that of the Kelvin sign to k, are left out, so that a match is always
+ * as long as the string searched for.
+ */
+static Rune
+foldrune(Rune r)
+{
+	/* Runes from lo to hi, step apart, fold to themselves plus delta */
+	static const struct {
+		Rune lo, hi;
+		int delta, step;
+	} folds[] = {
+		{ 0xC0, 0xD6, 32, 1 }, { 0xD8, 0xDE, 32, 1 },
+		{ 0x100, 0x12E, 1, 2 }, { 0x132, 0x136, 1, 2 },
+		{ 0x139, 0x147, 1, 2 }, { 0x14A, 0x176, 1, 2 },
+		{ 0x178, 0x178, -121, 1 }, { 0x179, 0x17D, 1, 2 },
+		{ 0x1CD, 0x1DB, 1, 2 }, { 0x1DE, 0x1EE, 1, 2 },
+		{ 0x1F8, 0x21E, 1, 2 }, { 0x222, 0x232, 1, 2 },
+		{ 0x370, 0x372, 1, 2 }, { 0x376, 0x376, 1, 1 },
+		{ 0x386, 0x386, 38, 1 }, { 0x388, 0x38A, 37, 1 },
+		{ 0x38C, 0x38C, 64, 1 }, { 0x38E, 0x38F, 63, 1 },
+		{ 0x391, 0x3A1, 32, 1 }, { 0x3A3, 0x3AB, 32, 1 },
+		{ 0x3C2, 0x3C2, 1, 1 }, { 0x3D8, 0x3EE, 1, 2 },
+		{ 0x400, 0x40F, 80, 1 }, { 0x410, 0x42F, 32, 1 },
+		{ 0x460, 0x480, 1, 2 }, { 0x48A, 0x4BE, 1, 2 },
+		{ 0x4C0, 0x4C0, 15, 1 }, { 0x4C1, 0x4CD, 1, 2 },
+		{ 0x4D0, 0x52E, 1, 2 }, { 0x531, 0x556, 48, 1 },
+		{ 0x10A0, 0x10C5, 7264, 1 }, { 0x1E00, 0x1E94, 1, 2 },
+		{ 0x1EA0, 0x1EFE, 1, 2 }, { 0x2160, 0x216F, 16, 1 },
+		{ 0x24B6, 0x24CF, 26, 1 }, { 0x2C00, 0x2C2E, 48, 1 },
+		{ 0x2C80, 0x2CE2, 1, 2 }, { 0xA640, 0xA66C, 1, 2 },
+		{ 0xA680, 0xA69A, 1, 2 }, { 0xA722, 0xA72E, 1, 2 },
+		{ 0xA732, 0xA76E, 1, 2 }, { 0xFF21, 0xFF3A, 32, 1 },
+		{ 0x10400, 0x10427, 40, 1 },
+	};
+	size_t lo, hi, mid;
+
+	if (r < 0x80)
+		return r >= 'A' && r <= 'Z' ? r + 32 : r;
+	lo = 0;
+	hi = LEN(folds);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (folds[mid].hi < r)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < LEN(folds) && folds[lo].lo <= r && (r - folds[lo].lo) % folds[lo].step == 0)
+		return r + folds[lo].delta;
+	return r;
+}
+
 static size_t
-linelen(const Rune *line)
+hexrowlen(size_t cols)
 {
-	size_t len;
+	size_t n;
 
-	len = 0;
-	while (*line++ != RUNE_EOF)
-		len++;
-	return len;
+	/* Each byte takes four columns, plus an offset and two separators */
+	for (n = 16; n > 1 && 13 + 4 * n > cols; n /= 2)
+		;
+	return n;
 }
 
 static size_t
@@ -333,6 +1193,45 @@ printwidth(Rune r)
 	return 1;
 }
 
+/* Formats the ANSI sequence moving the cursor to row y and column x */
+static size_t
+sprintgoto(char *s, size_t y, size_t x)
+{
+	char d[24];
+	size_t i, j, n, v;
+
+	n = 0;
+	s[n++] = '\033';
+	s[n++] = '[';
+	for (i = 0; i < 2; i++) {
+		v = (i == 0 ? y : x) + 1;
+		for (j = 0; v || j == 0; v /= 10)
+			d[j++] = '0' + v % 10;
+		while (j)
+			s[n++] = d[--j];
+		s[n++] = i == 0 ? ';' : 'H';
+	}
+	s[n] = '\0';
+	return n;
+}
+
+/* Formats n in decimal, with commas between groups of three digits */
+static size_t
+sprintcount(char *s, size_t n)
+{
+	char d[24];
+	size_t i, j, len;
+
+	len = sprintf(d, "%zu", n);
+	for (i = j = 0; i < len; i++) {
+		if (i > 0 && (len - i) % 3 == 0)
+			s[j++] = ',';
+		s[j++] = d[i];
+	}
+	s[j] = '\0';
+	return j;
+}
+
 static size_t
 sprintrune(char *s, Rune r)
 {
@@ -439,365 +1338,3004 @@ utfpeeklen(char c)
 	return 1;
 }
 
-static Buffer *
-bufnew(size_t width)
+static Encoding
+sniffencoding(const char *s, size_t len, size_t *bomlen)
 {
-	Buffer *buf;
+	size_t i, n, evennul, oddnul, valid, invalid;
+	Rune r;
 
-	buf = xmalloc(sizeof(*buf));
-	buf->linecap = width + 2;
-	buf->len = 0;
-	buf->cap = 128;
-	buf->lines = xmalloc(buf->cap * sizeof(*buf->lines));
-	return buf;
+	*bomlen = 0;
+	if (len >= 3 && !memcmp(s, "\xEF\xBB\xBF", 3)) {
+		*bomlen = 3;
+		return ENC_UTF8;
+	} else if (len >= 2 && !memcmp(s, "\xFF\xFE", 2)) {
+		*bomlen = 2;
+		return ENC_UTF16LE;
+	} else if (len >= 2 && !memcmp(s, "\xFE\xFF", 2)) {
+		*bomlen = 2;
+		return ENC_UTF16BE;
+	}
+
+	/*
+	 * Without a BOM, UTF-16 text that is mostly ASCII gives itself away by
+	 * having a NUL in every other byte.
+	 */
+	evennul = oddnul = 0;
+	for (i = 0; i < len; i++)
+		if (s[i] == '\0') {
+			if (i % 2)
+				oddnul++;
+			else
+				evennul++;
+		}
+	if (len >= 4 && oddnul >= len / 4 && evennul == 0)
+		return ENC_UTF16LE;
+	if (len >= 4 && evennul >= len / 4 && oddnul == 0)
+		return ENC_UTF16BE;
+
+	/*
+	 * A stray byte or two is no reason to garble the real UTF-8 around it,
+	 * so the text is only taken to be Latin-1 when its invalid bytes
+	 * outnumber its valid multibyte runes.
+	 */
+	valid = invalid = 0;
+	for (i = 0; i < len; i += n) {
+		if (utfpeeklen(s[i]) > len - i)
+			break; /* Truncated by the end of the sample */
+		n = utfdecode(s + i, len - i, &r);
+		if (r == RUNE_INVALID && n == 1)
+			invalid++;
+		else if (n > 1)
+			valid++;
+	}
+	return invalid > valid ? ENC_LATIN1 : ENC_UTF8;
 }
 
-static void
-buffree(Buffer *buf)
+/*
+ * The transcoders below take a fast path over runs of ASCII, testing eight
+ * bytes at a time with a single mask. The masks are built from byte arrays so
+ * that the test does not depend on the host's byte order.
+ */
+static const unsigned char asciimask8[8] = {
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+static const unsigned char asciimask16le[8] = {
+	0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF,
+};
+static const unsigned char asciimask16be[8] = {
+	0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80,
+};
+
+static size_t
+latin1toutf8(char *dst, const char *src, size_t len)
 {
-	size_t i;
+	uint64_t mask, w;
+	size_t i, n;
+
+	memcpy(&mask, asciimask8, sizeof(mask));
+	n = 0;
+	for (i = 0; i < len;) {
+		if (len - i >= 8) {
+			memcpy(&w, src + i, sizeof(w));
+			if (!(w & mask)) {
+				memcpy(dst + n, src + i, 8);
+				i += 8;
+				n += 8;
+				continue;
+			}
+		}
+		n += utfencode(dst + n, (unsigned char)src[i++]);
+	}
+	return n;
+}
 
-	for (i = 0; i < buf->len; i++)
-		free(buf->lines[i]);
-	free(buf->lines);
-	free(buf);
+static size_t
+utf16toutf8(char *dst, const char *src, size_t len, int be, size_t *used)
+{
+	const unsigned char *u;
+	uint64_t mask, w;
+	size_t i, n;
+	Rune r, lo;
+
+	u = (const unsigned char *)src;
+	memcpy(&mask, be ? asciimask16be : asciimask16le, sizeof(mask));
+	n = 0;
+	for (i = 0; i + 1 < len;) {
+		if (len - i >= 8) {
+			memcpy(&w, src + i, sizeof(w));
+			if (!(w & mask)) {
+				dst[n++] = u[i + be];
+				dst[n++] = u[i + 2 + be];
+				dst[n++] = u[i + 4 + be];
+				dst[n++] = u[i + 6 + be];
+				i += 8;
+				continue;
+			}
+		}
+
+		r = be ? u[i] << 8 | u[i + 1] : u[i + 1] << 8 | u[i];
+		if (r >= 0xD800 && r <= 0xDBFF) {
+			if (len - i < 4)
+				break; /* Wait for the low surrogate */
+			lo = be ? u[i + 2] << 8 | u[i + 3] : u[i + 3] << 8 | u[i + 2];
+			if (lo >= 0xDC00 && lo <= 0xDFFF) {
+				r = 0x10000 + ((r - 0xD800) << 10) + (lo - 0xDC00);
+				i += 2;
+			} else {
+				r = RUNE_INVALID;
+			}
+		} else if (r >= 0xDC00 && r <= 0xDFFF) {
+			r = RUNE_INVALID;
+		}
+		n += utfencode(dst + n, r);
+		i += 2;
+	}
+	*used = i;
+	return n;
 }
 
-static void
-bufgrow(Buffer *buf)
+static Attr
+sgrapply(Attr a, const int *params, size_t nparams)
 {
-	buf->cap *= 2;
-	buf->lines = xrealloc(buf->lines, buf->cap * sizeof(*buf->lines));
+	size_t i;
+	int c, r, g, b, which;
+
+	if (nparams == 0)
+		return 0;
+
+	for (i = 0; i < nparams; i++)
+		switch (c = params[i]) {
+		case 0: a = 0; break;
+		case 1: a |= ATTR_BOLD; break;
+		case 2: a |= ATTR_DIM; break;
+		case 3: a |= ATTR_ITALIC; break;
+		case 4: a |= ATTR_UNDERLINE; break;
+		case 5: case 6: a |= ATTR_BLINK; break;
+		case 7: a |= ATTR_REVERSE; break;
+		case 22: a &= ~(Attr)(ATTR_BOLD | ATTR_DIM); break;
+		case 23: a &= ~(Attr)ATTR_ITALIC; break;
+		case 24: a &= ~(Attr)ATTR_UNDERLINE; break;
+		case 25: a &= ~(Attr)ATTR_BLINK; break;
+		case 27: a &= ~(Attr)ATTR_REVERSE; break;
+		case 39: a = ATTR_SETFG(a, 0); break;
+		case 49: a = ATTR_SETBG(a, 0); break;
+		case 38: case 48:
+			which = c;
+			if (i + 2 < nparams && params[i + 1] == 5) {
+				c = (params[i + 2] & 0xFF) + 1;
+				i += 2;
+			} else if (i + 4 < nparams && params[i + 1] == 2) {
+				/* Approximate direct colour with the 6x6x6 cube */
+				r = params[i + 2] < 48 ? 0 : params[i + 2] < 115 ? 1 : (params[i + 2] - 35) / 40;
+				g = params[i + 3] < 48 ? 0 : params[i + 3] < 115 ? 1 : (params[i + 3] - 35) / 40;
+				b = params[i + 4] < 48 ? 0 : params[i + 4] < 115 ? 1 : (params[i + 4] - 35) / 40;
+				c = 16 + 36 * MIN(r, 5) + 6 * MIN(g, 5) + MIN(b, 5) + 1;
+				i += 4;
+			} else {
+				return a; /* Can't make sense of the rest */
+			}
+			a = which == 38 ? ATTR_SETFG(a, c) : ATTR_SETBG(a, c);
+			break;
+		default:
+			if (c >= 30 && c <= 37)
+				a = ATTR_SETFG(a, c - 30 + 1);
+			else if (c >= 40 && c <= 47)
+				a = ATTR_SETBG(a, c - 40 + 1);
+			else if (c >= 90 && c <= 97)
+				a = ATTR_SETFG(a, c - 90 + 8 + 1);
+			else if (c >= 100 && c <= 107)
+				a = ATTR_SETBG(a, c - 100 + 8 + 1);
+			break;
+		}
+
+	return a;
 }
 
-static int
-buflookingat(Buffer *buf, const Rune *s, size_t len, size_t row, size_t col)
+/*
+ * Writes the shortest SGR sequence taking the terminal from attributes from to
+ * attributes to. The buffer must have room for at least 64 bytes.
+ */
+static size_t
+sgrdiff(char *s, Attr from, Attr to)
 {
-	if (row >= buf->len || col >= buf->linecap)
+	static const struct {
+		Attr flag;
+		int on, off;
+	} flags[] = {
+		{ ATTR_BOLD, 1, 22 },
+		{ ATTR_DIM, 2, 22 },
+		{ ATTR_ITALIC, 3, 23 },
+		{ ATTR_UNDERLINE, 4, 24 },
+		{ ATTR_BLINK, 5, 25 },
+		{ ATTR_REVERSE, 7, 27 },
+	};
+	size_t i, n;
+	int c;
+
+	if (from == to)
 		return 0;
 
-	while (len-- > 0) {
-		if (buf->lines[row][col] != *s++)
-			return 0;
-		col++;
-		if (buf->lines[row][col] == RUNE_EOF) {
-			col = 0;
-			if (++row >= buf->len)
-				return 0;
+	n = sprintf(s, "\033[");
+	if (to == 0) {
+		n += sprintf(s + n, "0;");
+	} else {
+		/* 22 turns off both bold and dim, so they need special care */
+		if ((from & ~to & (ATTR_BOLD | ATTR_DIM))) {
+			n += sprintf(s + n, "22;");
+			from &= ~(Attr)(ATTR_BOLD | ATTR_DIM);
+		}
+		for (i = 0; i < LEN(flags); i++)
+			if ((from & flags[i].flag) && !(to & flags[i].flag))
+				n += sprintf(s + n, "%d;", flags[i].off);
+		for (i = 0; i < LEN(flags); i++)
+			if (!(from & flags[i].flag) && (to & flags[i].flag))
+				n += sprintf(s + n, "%d;", flags[i].on);
+
+		if (ATTR_FG(from) != ATTR_FG(to)) {
+			if ((c = ATTR_FG(to) - 1) < 0)
+				n += sprintf(s + n, "39;");
+			else if (c < 8)
+				n += sprintf(s + n, "%d;", 30 + c);
+			else if (c < 16)
+				n += sprintf(s + n, "%d;", 90 + c - 8);
+			else
+				n += sprintf(s + n, "38;5;%d;", c);
+		}
+		if (ATTR_BG(from) != ATTR_BG(to)) {
+			if ((c = ATTR_BG(to) - 1) < 0)
+				n += sprintf(s + n, "49;");
+			else if (c < 8)
+				n += sprintf(s + n, "%d;", 40 + c);
+			else if (c < 16)
+				n += sprintf(s + n, "%d;", 100 + c - 8);
+			else
+				n += sprintf(s + n, "48;5;%d;", c);
 		}
 	}
-	return 1;
+	s[n - 1] = 'm';
+	return n;
+}
+
+/*
+ * The scanners below look for candidate matches of a string by a pair of its
+ * bytes. Testing both bytes at once weeds out most false starts before
+ * anything is compared byte by byte. The forward scanners return the first
+ * i < n where s[i] and s[i + d] stand for the pair, or n if there is none; the
+ * reverse ones return the last such i, or SIZE_MAX. The caller guarantees
+ * that s[i + d] is readable for every i < n.
+ */
+static void
+scaninit(void)
+{
+#ifdef HAVE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scanpair = scanpairavx2;
+		rscanpair = rscanpairavx2;
+	} else {
+		scanpair = scanpairsse2;
+		rscanpair = rscanpairsse2;
+	}
+#endif
+}
+
+static size_t
+scanpairbytes(const char *s, size_t n, const Pair *p)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (((unsigned char)s[i] | p->ma) == p->a &&
+		    ((unsigned char)s[i + p->d] | p->mb) == p->b)
+			return i;
+	return n;
+}
+
+static size_t
+rscanpairbytes(const char *s, size_t n, const Pair *p)
+{
+	while (n-- > 0)
+		if (((unsigned char)s[n] | p->ma) == p->a &&
+		    ((unsigned char)s[n + p->d] | p->mb) == p->b)
+			return n;
+	return SIZE_MAX;
 }
 
-static Rune *
-bufnewline(Buffer *buf)
+#ifdef HAVE_SIMD
+static size_t
+scanpairsse2(const char *s, size_t n, const Pair *p)
+{
+	__m128i va, vb, ma, mb, x, y;
+	size_t i;
+	int m;
+
+	va = _mm_set1_epi8(p->a);
+	vb = _mm_set1_epi8(p->b);
+	ma = _mm_set1_epi8(p->ma);
+	mb = _mm_set1_epi8(p->mb);
+	for (i = 0; n - i >= 16; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(s + i));
+		y = _mm_loadu_si128((const __m128i *)(s + i + p->d));
+		x = _mm_cmpeq_epi8(_mm_or_si128(x, ma), va);
+		y = _mm_cmpeq_epi8(_mm_or_si128(y, mb), vb);
+		if ((m = _mm_movemask_epi8(_mm_and_si128(x, y))))
+			return i + __builtin_ctz(m);
+	}
+	return i + scanpairbytes(s + i, n - i, p);
+}
+
+__attribute__((target("avx2"))) static size_t
+scanpairavx2(const char *s, size_t n, const Pair *p)
 {
-	Rune *line;
+	__m256i va, vb, ma, mb, x, y;
 	size_t i;
+	unsigned m;
+
+	va = _mm256_set1_epi8(p->a);
+	vb = _mm256_set1_epi8(p->b);
+	ma = _mm256_set1_epi8(p->ma);
+	mb = _mm256_set1_epi8(p->mb);
+	for (i = 0; n - i >= 32; i += 32) {
+		x = _mm256_loadu_si256((const __m256i *)(s + i));
+		y = _mm256_loadu_si256((const __m256i *)(s + i + p->d));
+		x = _mm256_cmpeq_epi8(_mm256_or_si256(x, ma), va);
+		y = _mm256_cmpeq_epi8(_mm256_or_si256(y, mb), vb);
+		if ((m = _mm256_movemask_epi8(_mm256_and_si256(x, y))))
+			return i + __builtin_ctz(m);
+	}
+	return i + scanpairbytes(s + i, n - i, p);
+}
 
-	if (buf->len == buf->cap)
-		bufgrow(buf);
-	line = buf->lines[buf->len++] = xmalloc(buf->linecap * sizeof(**buf->lines));
-	for (i = 0; i < buf->linecap; i++)
-		line[i] = RUNE_EOF;
-	return line;
+static size_t
+rscanpairsse2(const char *s, size_t n, const Pair *p)
+{
+	__m128i va, vb, ma, mb, x, y;
+	int m;
+
+	va = _mm_set1_epi8(p->a);
+	vb = _mm_set1_epi8(p->b);
+	ma = _mm_set1_epi8(p->ma);
+	mb = _mm_set1_epi8(p->mb);
+	for (; n >= 16; n -= 16) {
+		x = _mm_loadu_si128((const __m128i *)(s + n - 16));
+		y = _mm_loadu_si128((const __m128i *)(s + n - 16 + p->d));
+		x = _mm_cmpeq_epi8(_mm_or_si128(x, ma), va);
+		y = _mm_cmpeq_epi8(_mm_or_si128(y, mb), vb);
+		if ((m = _mm_movemask_epi8(_mm_and_si128(x, y))))
+			return n - 16 + 31 - __builtin_clz(m);
+	}
+	return rscanpairbytes(s, n, p);
+}
+
+__attribute__((target("avx2"))) static size_t
+rscanpairavx2(const char *s, size_t n, const Pair *p)
+{
+	__m256i va, vb, ma, mb, x, y;
+	unsigned m;
+
+	va = _mm256_set1_epi8(p->a);
+	vb = _mm256_set1_epi8(p->b);
+	ma = _mm256_set1_epi8(p->ma);
+	mb = _mm256_set1_epi8(p->mb);
+	for (; n >= 32; n -= 32) {
+		x = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+		y = _mm256_loadu_si256((const __m256i *)(s + n - 32 + p->d));
+		x = _mm256_cmpeq_epi8(_mm256_or_si256(x, ma), va);
+		y = _mm256_cmpeq_epi8(_mm256_or_si256(y, mb), vb);
+		if ((m = _mm256_movemask_epi8(_mm256_and_si256(x, y))))
+			return n - 32 + 31 - __builtin_clz(m);
+	}
+	return rscanpairbytes(s, n, p);
 }
+#endif
 
 static Buffer *
-bufreflow(Buffer *buf, size_t width, size_t row, size_t *newrow)
-{
-	Buffer *new;
-	Rune *oldl, *newl;
-	size_t i, j, c, w;
-	int needline;
-
-	new = bufnew(width);
-	needline = 1;
-	c = j = 0;
-
-	for (i = 0; i < buf->len; i++) {
-		for (oldl = buf->lines[i]; *oldl != RUNE_EOF; oldl++) {
-			w = printwidth(*oldl);
-			if (needline || c + w > width || j >= new->linecap - 1) {
-				newl = bufnewline(new);
-				c = j = 0;
-				needline = 0;
-			}
+bufnew(void)
+{
+	Buffer *buf;
 
-			*newl++ = *oldl;
-			j++;
-			if (*oldl == '\n')
-				needline = 1;
-			else if (*oldl == '\t')
-				c = nexttabstop(c);
-			else
-				c += w;
-		}
+	buf = xmalloc(sizeof(*buf));
+	buf->textlen = buf->nruns = 0;
+	buf->textcap = BUFSIZ;
+	buf->text = xmalloc(buf->textcap);
+	buf->runscap = 16;
+	buf->runs = xmalloc(buf->runscap * sizeof(*buf->runs));
+	if (pthread_rwlock_init(&buf->lock, NULL))
+		die(1, "pthread_rwlock_init");
+	return buf;
+}
+
+static void
+buffree(Buffer *buf)
+{
+	pthread_rwlock_destroy(&buf->lock);
+	free(buf->text);
+	free(buf->runs);
+	free(buf);
+}
 
-		if (i == row - 1 && newrow)
-			*newrow = new->len;
-		free(buf->lines[i]);
+/*
+ * Returns the attributes of the text at off. If next is not NULL, it is set
+ * to the offset of the next attribute change after off.
+ */
+static Attr
+bufattr(Buffer *buf, size_t off, size_t *next)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = buf->nruns;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (buf->runs[mid].pos <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	if (i <= row - 1 && newrow)
-		*newrow = new->len;
+	if (next)
+		*next = lo < buf->nruns ? buf->runs[lo].pos : SIZE_MAX;
+	return lo > 0 ? buf->runs[lo - 1].attr : 0;
+}
+
+/* Returns the column of off within its line, were the line not wrapped */
+static size_t
+bufcolumn(Buffer *buf, size_t off)
+{
+	size_t i, col;
+	Rune r;
 
-	free(buf->lines);
-	return new;
+	for (col = 0, i = buflinestart(buf, off); i < off;) {
+		i += utfdecode(buf->text + i, off - i, &r);
+		col += r == '\t' ? nexttabstop(col) - col : r == '\n' ? 0 : printwidth(r);
+	}
+	return col;
 }
 
-static int
-bufsearchbackwards(Buffer *buf, const Rune *s, size_t len, size_t row, size_t *found)
+static size_t
+buflineend(Buffer *buf, size_t off)
 {
-	size_t i, j;
+	const char *p;
 
-	if (len == 0 || buf->len == 0 || row == 0)
-		return 1;
+	if (off >= buf->textlen)
+		return buf->textlen;
+	p = memchr(buf->text + off, '\n', buf->textlen - off);
+	return p ? (size_t)(p - buf->text) : buf->textlen;
+}
+
+static size_t
+buflinestart(Buffer *buf, size_t off)
+{
+	while (off > 0 && buf->text[off - 1] != '\n')
+		off--;
+	return off;
+}
 
-	if (row >= buf->len - 1)
-		row = buf->len - 1;
+/* Finds the first line start at or after off, or else end */
+static size_t
+buflinenext(Buffer *buf, size_t off, size_t end)
+{
+	const char *nl;
+
+	if (off >= end || off == 0 || buf->text[off - 1] == '\n')
+		return MIN(off, end);
+	nl = memchr(buf->text + off, '\n', end - off);
+	return nl ? (size_t)(nl - buf->text) + 1 : end;
+}
 
-	i = row - 1;
-	j = linelen(buf->lines[i]);
+/* Finds the last occurrence of the pattern's string starting before off */
+static int
+buffindbackwards(Buffer *buf, const Pattern *pat, size_t off, size_t *found)
+{
+	size_t (*scan)(const char *, size_t, const Pair *);
+	const char *t;
+	size_t i, n, len, step;
+
+	len = pat->len;
+	if (len == 0 || len > buf->textlen || off == 0)
+		return 1;
 
+	t = buf->text;
+	i = MIN(off - 1, buf->textlen - len);
+	scan = rscanpair ? rscanpair : pat->icase ? rscanpairbytes : NULL;
+	if (scan && pat->pair.at != SIZE_MAX) {
+		for (n = i + 1; (i = scan(t + pat->pair.at, n, &pat->pair)) != SIZE_MAX; n = i) {
+			if (patequal(pat, t + i)) {
+				if (found)
+					*found = i;
+				return 0;
+			}
+		}
+		return 1;
+	}
+	if (pat->icase) {
+		/* Nothing in the string is safe to scan for, so try everywhere */
+		for (n = i + 1; n-- > 0;) {
+			if (patequal(pat, t + n)) {
+				if (found)
+					*found = n;
+				return 0;
+			}
+		}
+		return 1;
+	}
 	for (;;) {
-		if (buf->lines[i][j] == s[0] && buflookingat(buf, s, len, i, j)) {
+		if (t[i] == pat->s[0] && !memcmp(t + i + 1, pat->s + 1, len - 1)) {
 			if (found)
 				*found = i;
 			return 0;
 		}
-
-		if (j-- == 0) {
-			if (i-- == 0)
-				return 1;
-			j = linelen(buf->lines[i]);
-		}
+		step = pat->rskip[(unsigned char)t[i]];
+		if (step > i)
+			return 1;
+		i -= step;
 	}
 }
 
+/*
+ * Finds the first occurrence of the pattern's string at or after off that
+ * lies before end
+ */
 static int
-bufsearchforwards(Buffer *buf, const Rune *s, size_t len, size_t row, size_t *found)
+buffindforwards(Buffer *buf, const Pattern *pat, size_t off, size_t end, size_t *found)
 {
-	size_t i, j;
+	size_t (*scan)(const char *, size_t, const Pair *);
+	const char *t, *p, *last;
+	size_t i, n, len;
 
-	if (len == 0 || row + 1 >= buf->len)
+	len = pat->len;
+	if (len == 0 || off >= end || len > end - off)
 		return 1;
 
-	i = row + 1;
-	j = 0;
+	t = buf->text;
+	last = t + end - len;
+	n = last - t + 1;
+	scan = scanpair ? scanpair : pat->icase ? scanpairbytes : NULL;
+	if (scan && pat->pair.at != SIZE_MAX) {
+		for (i = off; (i += scan(t + pat->pair.at + i, n - i, &pat->pair)) < n; i++) {
+			if (patequal(pat, t + i)) {
+				if (found)
+					*found = i;
+				return 0;
+			}
+		}
+		return 1;
+	}
+	if (pat->icase) {
+		for (i = off; i < n; i++) {
+			if (patequal(pat, t + i)) {
+				if (found)
+					*found = i;
+				return 0;
+			}
+		}
+		return 1;
+	}
+	/*
+	 * A short needle can't skip far, so memchr does better on it, and the
+	 * repeated comparisons cost little.
+	 */
+	if (len < 4) {
+		for (p = t + off; p <= last && (p = memchr(p, pat->s[0], last - p + 1)); p++) {
+			if (!memcmp(p, pat->s, len)) {
+				if (found)
+					*found = p - t;
+				return 0;
+			}
+		}
+		return 1;
+	}
 
-	for (;;) {
-		if (buf->lines[i][j] == s[0] && buflookingat(buf, s, len, i, j)) {
+	for (p = t + off; p <= last; p += pat->skip[(unsigned char)p[len - 1]]) {
+		if (p[len - 1] == pat->s[len - 1] && !memcmp(p, pat->s, len - 1)) {
 			if (found)
-				*found = i;
+				*found = p - t;
 			return 0;
 		}
-
-		if (buf->lines[i][++j] == RUNE_EOF) {
-			if (++i == buf->len)
-				return 1;
-			j = 0;
-		}
 	}
+	return 1;
 }
 
-static Window *
-winnew(size_t rows, size_t cols)
+/*
+ * Lays out the text between from and to, returning the offsets of the rows in
+ * an allocated array. from must be where a row starts, and to must be where a
+ * line starts or the end of the text. Large spans are split at line starts and
+ * laid out in parallel, since each line is laid out independently.
+ */
+static size_t *
+buflayout(Buffer *buf, size_t from, size_t to, size_t width, size_t *len)
 {
-	Window *win;
+	Chunk *chunks;
+	Task *tasks;
+	size_t *rows, n, i, start, split, pending;
+
+	if (nworkers == SIZE_MAX)
+		poolinit();
+	start = from;
+	n = MIN((to - from) / CHUNKSIZE + 1, 4 * (nworkers + 1));
+	chunks = xmalloc(n * sizeof(*chunks));
+	tasks = xmalloc(n * sizeof(*tasks));
+
+	for (i = 0; i < n; i++) {
+		split = i + 1 < n ? start + (to - start) / n * (i + 1) : to;
+		if (i + 1 < n && split > from)
+			split = buflinenext(buf, split, to);
+		chunks[i].buf = buf;
+		chunks[i].from = from;
+		chunks[i].to = from = MAX(split, from);
+		chunks[i].width = width;
+		tasks[i].func = buflayoutchunk;
+		tasks[i].arg = &chunks[i];
+		tasks[i].pending = &pending;
+	}
 
-	win = xmalloc(sizeof(*win));
-	win->buf = bufnew(cols);
-	win->rows = rows;
-	win->cols = cols;
-	win->row = 0;
-	return win;
+	pending = n;
+	for (i = 1; i < n; i++)
+		poolsubmit(&tasks[i]);
+	buflayoutchunk(&chunks[0]);
+	pthread_mutex_lock(&poollock);
+	pending--;
+	pthread_mutex_unlock(&poollock);
+	poolwait(&pending);
+
+	for (*len = 0, i = 0; i < n; i++)
+		*len += chunks[i].len;
+	rows = xmalloc((*len + 1) * sizeof(*rows));
+	for (*len = 0, i = 0; i < n; i++) {
+		memcpy(rows + *len, chunks[i].rows, chunks[i].len * sizeof(*rows));
+		*len += chunks[i].len;
+		free(chunks[i].rows);
+	}
+	free(tasks);
+	free(chunks);
+	return rows;
 }
 
 static void
-winfree(Window *win)
+buflayoutchunk(void *arg)
 {
-	buffree(win->buf);
-	free(win);
+	Chunk *c;
+	size_t off;
+
+	c = arg;
+	c->len = 0;
+	c->cap = (c->to - c->from) / (MIN(c->width, 256) + 1) + 16;
+	c->rows = xmalloc(c->cap * sizeof(*c->rows));
+	for (off = c->from; off < c->to; off = bufrowend(c->buf, off, c->width, 1)) {
+		if (c->len == c->cap) {
+			c->cap *= 2;
+			c->rows = xrealloc(c->rows, c->cap * sizeof(*c->rows));
+		}
+		c->rows[c->len++] = off;
+	}
 }
 
-static void
-winfill(Window *win, Input *in)
+/*
+ * Finds the last match of a regular expression in the lines between from and
+ * to that starts before before. Matches are taken in turn without overlapping.
+ */
+static int
+bufmatchlast(Buffer *buf, const Pattern *pat, size_t from, size_t to, size_t before, size_t *found)
 {
-	size_t newrows;
-
-	newrows = 0;
-	while (win->buf->len < win->rows)
-		if (wingetline(win, in))
-			break;
-		else
-			newrows++;
+	size_t start, end, last;
 
-	win->row += newrows;
+	last = SIZE_MAX;
+	while (from <= to && !patmatch(pat, buf->text, from, to, &start, &end) && start < before) {
+		last = start;
+		from = MAX(end, start + 1);
+	}
+	if (last == SIZE_MAX)
+		return 1;
+	if (found)
+		*found = last;
+	return 0;
 }
 
 static int
-wingetline(Window *win, Input *in)
+bufread(Buffer *buf, Input *in)
 {
-	Rune *line;
-	size_t i, w;
 	Rune r;
 
-	if (inputatend(in))
+	if ((r = inputgetrune(in)) == RUNE_EOF)
 		return 1;
 
-	line = bufnewline(win->buf);
-	w = 0;
-	for (i = 0; i < win->buf->linecap - 1; i++)
-		if ((r = inputgetrune(in)) == RUNE_EOF) {
-			break;
-		} else if (w + printwidth(r) > win->cols) {
-			inputungetrune(in, r);
-			break;
-		} else {
-			line[i] = r;
-			if (r == '\t')
-				w = nexttabstop(w);
-			else
-				w += printwidth(r);
-			if (r == '\n')
-				break;
+	do {
+		if (buf->textcap - buf->textlen < 4) {
+			pthread_rwlock_wrlock(&buf->lock);
+			buf->textcap *= 2;
+			buf->text = xrealloc(buf->text, buf->textcap);
+			pthread_rwlock_unlock(&buf->lock);
+		}
+		if (in->attr != (buf->nruns > 0 ? buf->runs[buf->nruns - 1].attr : 0)) {
+			if (buf->nruns == buf->runscap) {
+				buf->runscap *= 2;
+				buf->runs = xrealloc(buf->runs, buf->runscap * sizeof(*buf->runs));
+			}
+			buf->runs[buf->nruns].pos = buf->textlen;
+			buf->runs[buf->nruns++].attr = in->attr;
 		}
+		if (r > 0x10FFFF)
+			r = RUNE_INVALID;
+		buf->textlen += utfencode(buf->text + buf->textlen, r);
+	} while (inputbuffered(in) && (r = inputgetrune(in)) != RUNE_EOF);
 
 	return 0;
 }
 
-static void
-winresize(Window *win, size_t rows, size_t cols, Input *in)
+/*
+ * Returns the offset where the row starting at off ends when laid out at the
+ * given width, or SIZE_MAX if that depends on text that hasn't been read yet.
+ * If final is set, the text read so far is all there is.
+ */
+static size_t
+bufrowend(Buffer *buf, size_t off, size_t width, int final)
 {
-	win->rows = rows;
-	win->buf = bufreflow(win->buf, cols, win->row, &win->row);
-	winfill(win, in);
+	size_t c, n, w;
+	Rune r;
+
+	c = n = 0;
+	while (off < buf->textlen) {
+		if ((unsigned char)buf->text[off] < 0x80)
+			r = buf->text[off];
+		else
+			utfdecode(buf->text + off, buf->textlen - off, &r);
+		w = printwidth(r);
+		if (n > 0 && (c + w > width || n > width))
+			return off;
+
+		off += utfpeeklen(buf->text[off]);
+		n++;
+		if (r == '\n')
+			return off;
+		else if (r == '\t')
+			c = nexttabstop(c);
+		else
+			c += w;
+	}
+	return final ? off : SIZE_MAX;
 }
 
-static void
-winscrollbot(Window *win, Input *in)
+/*
+ * Finds the last match starting before off. For a regular expression, the
+ * line holding off is tried in full first, since a match there can start
+ * before off while its required string lies after it. Matches never span
+ * lines, so the lines before it are tried one by one where the required
+ * string turns up, or else in blocks that grow the further back they go.
+ */
+static int
+bufsearchbackwards(Buffer *buf, const Pattern *pat, size_t off, size_t *found)
 {
-	while (!wingetline(win, in))
-		;
-	win->row = win->buf->len;
+	size_t from, to, before, lit, block;
+
+	if (!pat->isregex)
+		return buffindbackwards(buf, pat, off, found);
+	if (off == 0 || buf->textlen == 0)
+		return 1;
+
+	off = MIN(off, buf->textlen);
+	from = buflinestart(buf, off - 1);
+	to = buflineend(buf, off - 1);
+	before = off;
+	block = BUFSIZ;
+	while (bufmatchlast(buf, pat, from, to, before, found)) {
+		if (from == 0)
+			return 1;
+		before = SIZE_MAX;
+		if (pat->len > 0) {
+			if (buffindbackwards(buf, pat, from, &lit))
+				return 1;
+			from = buflinestart(buf, lit);
+			to = buflineend(buf, lit);
+		} else {
+			to = from - 1;
+			from = buflinestart(buf, to > block ? to - block : 0);
+			block = MIN(2 * block, CHUNKSIZE);
+		}
+	}
+	return 0;
 }
 
-static void
-winscrolldown(Window *win, size_t lines, Input *in)
+/*
+ * Finds the first match starting at or after off that lies before end, and
+ * where it ends. Only the text before end is looked at, so that it can be
+ * searched while more is being appended.
+ */
+static int
+bufsearchforwards(Buffer *buf, const Pattern *pat, size_t off, size_t end, size_t *found, size_t *foundend)
 {
-	while (win->buf->len < win->row + lines) {
-		if (wingetline(win, in))
-			break;
+	const char *nl;
+	size_t from, to, lit, start, stop;
+
+	if (!pat->isregex) {
+		if (buffindforwards(buf, pat, off, end, &start))
+			return 1;
+		stop = start + pat->len;
+		goto done;
 	}
 
-	win->row += lines;
-	if (win->row > win->buf->len)
-		win->row = win->buf->len;
+	while (off < end) {
+		if (pat->len > 0) {
+			if (buffindforwards(buf, pat, off, end, &lit))
+				return 1;
+			from = MAX(off, buflinestart(buf, lit));
+			to = lit;
+		} else {
+			from = off;
+			to = MIN(off + CHUNKSIZE, end);
+		}
+		nl = memchr(buf->text + to, '\n', end - to);
+		to = nl ? (size_t)(nl - buf->text) : end;
+		if (!patmatch(pat, buf->text, from, to, &start, &stop))
+			goto done;
+		off = to + 1;
+	}
+	return 1;
+
+done:
+	if (found)
+		*found = start;
+	if (foundend)
+		*foundend = stop;
+	return 0;
 }
 
-static void
-winscrolltop(Window *win)
+static Layout *
+laynew(size_t width, size_t start)
 {
-	win->row = MIN(win->rows, win->buf->len);
+	Layout *lay;
+
+	lay = xmalloc(sizeof(*lay));
+	lay->len = 0;
+	lay->cap = 128;
+	lay->rows = lay->mem = xmalloc(lay->cap * sizeof(*lay->mem));
+	lay->end = start;
+	lay->width = width;
+	return lay;
 }
 
 static void
-winscrollup(Window *win, size_t lines)
+layfree(Layout *lay)
 {
-	win->row = lines > win->row ? 0 : win->row - lines;
-	if (win->row < win->rows)
-		win->row = MIN(win->rows, win->buf->len);
+	free(lay->mem);
+	free(lay);
 }
 
+/* Makes room for front more rows before the first and back more after the last */
 static void
-winsearchbackwards(Window *win, const Rune *s, size_t len)
+layreserve(Layout *lay, size_t front, size_t back)
 {
-	size_t row;
+	size_t head, slack, *mem;
 
-	if (win->row == 0 || win->buf->len == 0 || win->row <= win->rows)
+	head = lay->rows - lay->mem;
+	if (head >= front && lay->cap - head - lay->len >= back)
 		return;
 
-	row = win->row - win->rows;
-	if (bufsearchbackwards(win->buf, s, len, row, &row))
-		return;
-	win->row = MIN(row + win->rows, win->buf->len);
+	slack = lay->len + 128;
+	head = front > 0 ? front + slack : head;
+	lay->cap = head + lay->len + back + slack;
+	mem = xmalloc(lay->cap * sizeof(*mem));
+	memcpy(mem + head, lay->rows, lay->len * sizeof(*mem));
+	free(lay->mem);
+	lay->mem = mem;
+	lay->rows = mem + head;
 }
 
-static void
-winsearchforwards(Window *win, const Rune *s, size_t len, Input *in)
+/* Returns the row containing off, which must be within the layout */
+static size_t
+layfind(Layout *lay, size_t off)
 {
-	size_t row;
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = lay->len;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (lay->rows[mid] <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
-	if (win->row == 0 || win->buf->len == 0)
-		return;
-	row = win->row - 1;
+static size_t
+layrowend(Layout *lay, size_t row)
+{
+	return row + 1 < lay->len ? lay->rows[row + 1] : lay->end;
+}
+
+static size_t
+laystart(Layout *lay)
+{
+	return lay->len > 0 ? lay->rows[0] : lay->end;
+}
+
+static Index *
+idxnew(Buffer *buf)
+{
+	Index *x;
+	size_t i;
+
+	x = xmalloc(sizeof(*x));
+	x->buf = buf;
+	x->len = x->end = x->merged = 0;
+	x->cap = 64;
+	x->blocks = xmalloc(x->cap * sizeof(*x->blocks));
+	for (i = 0; i < LEN(x->post); i++) {
+		x->post[i].data = NULL;
+		x->post[i].len = x->post[i].cap = x->post[i].next = 0;
+	}
+	return x;
+}
+
+static void
+idxfree(Index *x)
+{
+	size_t i;
+
+	for (i = 0; i < x->len; i++) {
+		poolwait(&x->blocks[i]->pending);
+		free(x->blocks[i]->keys);
+		free(x->blocks[i]);
+	}
+	for (i = 0; i < LEN(x->post); i++)
+		free(x->post[i].data);
+	free(x->blocks);
+	free(x);
+}
+
+static void
+idxblock(void *arg)
+{
+	unsigned char seen[IDXKEYS / 8];
+	Block *b;
+	size_t i, j;
+	uint32_t t;
+	unsigned key;
+
+	b = arg;
+	memset(seen, 0, sizeof(seen));
+	pthread_rwlock_rdlock(&b->buf->lock);
+	for (t = 0, i = b->from; i < b->to; i++) {
+		t = (t << 8 | idxfold(b->buf->text[i])) & 0xFFFFFF;
+		if (i < b->from + 2)
+			continue;
+		key = idxkey(t);
+		seen[key / 8] |= 1 << key % 8;
+	}
+	pthread_rwlock_unlock(&b->buf->lock);
+
+	for (i = 0; i < sizeof(seen); i++)
+		for (j = 0; j < 8; j++)
+			b->nkeys += seen[i] >> j & 1;
+	b->keys = xmalloc(MAX(b->nkeys, 1) * sizeof(*b->keys));
+	for (b->nkeys = i = 0; i < IDXKEYS; i++)
+		if (seen[i / 8] >> i % 8 & 1)
+			b->keys[b->nkeys++] = i;
+}
+
+/*
+ * Brings c up to date with the blocks in the posting lists, reading only the
+ * postings added since the last time. A block might hold a match of pat if it
+ * has every one of the keys of pat's trigrams. Returns how many blocks c
+ * covers, which is zero if pat has no trigrams to look up. When case is
+ * ignored, only trigrams of ASCII characters can be looked up, since other
+ * characters may fold to different bytes.
+ */
+static size_t
+idxcandidates(Index *x, const Pattern *pat, Candidates *c)
+{
+	unsigned char seen[IDXKEYS / 8];
+	const char *s;
+	Posting *p;
+	size_t i, j, d, shift, b;
+	unsigned key;
+
+	if (c->nkeys == SIZE_MAX) {
+		s = pat->icase ? pat->fs : pat->s;
+		c->keys = xmalloc(MAX(pat->len, 1) * sizeof(*c->keys));
+		memset(seen, 0, sizeof(seen));
+		for (i = c->nkeys = 0; i + 2 < pat->len && c->nkeys < UCHAR_MAX; i++) {
+			if (pat->icase && (s[i] | s[i + 1] | s[i + 2]) & 0x80)
+				continue;
+			key = idxkey((uint32_t)idxfold(s[i]) << 16 | idxfold(s[i + 1]) << 8 | idxfold(s[i + 2]));
+			if (seen[key / 8] >> key % 8 & 1)
+				continue;
+			seen[key / 8] |= 1 << key % 8;
+			c->keys[c->nkeys++] = key;
+		}
+		c->pos = xmalloc(MAX(c->nkeys, 1) * sizeof(*c->pos));
+		c->next = xmalloc(MAX(c->nkeys, 1) * sizeof(*c->next));
+		for (i = 0; i < c->nkeys; i++)
+			c->pos[i] = c->next[i] = 0;
+	}
+	if (c->nkeys == 0)
+		return 0;
+
+	idxmerge(x);
+	if (x->merged > c->len) {
+		c->count = xrealloc(c->count, x->merged);
+		memset(c->count + c->len, 0, x->merged - c->len);
+		c->len = x->merged;
+	}
+	for (i = 0; i < c->nkeys; i++) {
+		p = &x->post[c->keys[i]];
+		for (j = c->pos[i]; j < p->len; c->next[i] = b + 1) {
+			for (d = shift = 0; p->data[j] & 0x80; shift += 7)
+				d |= (size_t)(p->data[j++] & 0x7F) << shift;
+			d |= (size_t)p->data[j++] << shift;
+			b = c->next[i] + d;
+			c->count[b]++;
+		}
+		c->pos[i] = j;
+	}
+	return c->len;
+}
+
+/*
+ * Hands the text read so far to the workers to be indexed, in blocks of about
+ * the same size. Unless the text is final, what is left over that wouldn't
+ * make a whole block is left for later.
+ */
+static void
+idxextend(Index *x, int final)
+{
+	Block *b;
+	size_t from, to, end;
+
+	end = final ? x->buf->textlen : buflinestart(x->buf, x->buf->textlen);
+	for (from = x->end; from < end; from = to) {
+		if (end - from <= CHUNKSIZE && !final)
+			break;
+		to = buflinenext(x->buf, from + CHUNKSIZE, end);
+		if (x->len == x->cap) {
+			x->cap *= 2;
+			x->blocks = xrealloc(x->blocks, x->cap * sizeof(*x->blocks));
+		}
+		b = x->blocks[x->len++] = xmalloc(sizeof(*b));
+		b->buf = x->buf;
+		b->from = from;
+		b->to = to;
+		b->keys = NULL;
+		b->nkeys = 0;
+		b->pending = 1;
+		b->task.func = idxblock;
+		b->task.arg = b;
+		b->task.pending = &b->pending;
+		poolsubmit(&b->task);
+	}
+	x->end = from;
+	idxmerge(x);
+}
+
+/* Returns the index of the block holding off, or the number of blocks */
+static size_t
+idxfind(Index *x, size_t off)
+{
+	size_t lo, hi, mid;
+
+	for (lo = 0, hi = x->len; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (x->blocks[mid]->to <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Folds ASCII letters to lower case, as trigrams are indexed */
+static unsigned
+idxfold(char c)
+{
+	unsigned char u;
+
+	u = c;
+	return (unsigned)(u - 'A') < 26 ? u | 0x20 : u;
+}
+
+/* Hashes a trigram, given as its bytes in the low 24 bits of t, to a key */
+static unsigned
+idxkey(uint32_t t)
+{
+	return (uint32_t)(t * 2654435761u) >> 16;
+}
+
+/* Adds the blocks that have been indexed to the posting lists, in order */
+static void
+idxmerge(Index *x)
+{
+	Block *b;
+	Posting *p;
+	size_t i, d;
+	int done;
+
+	for (; x->merged < x->len; x->merged++) {
+		b = x->blocks[x->merged];
+		pthread_mutex_lock(&poollock);
+		done = b->pending == 0;
+		pthread_mutex_unlock(&poollock);
+		if (!done)
+			return;
+		for (i = 0; i < b->nkeys; i++) {
+			p = &x->post[b->keys[i]];
+			if (p->cap - p->len < 10) {
+				p->cap = MAX(2 * p->cap, 16);
+				p->data = xrealloc(p->data, p->cap);
+			}
+			for (d = x->merged - p->next; d >= 0x80; d >>= 7)
+				p->data[p->len++] = (d & 0x7F) | 0x80;
+			p->data[p->len++] = d;
+			p->next = x->merged + 1;
+		}
+		free(b->keys);
+		b->keys = NULL;
+	}
+}
+
+static Keywords *
+kwnew(void)
+{
+	Keywords *kw;
+	size_t i;
+
+	kw = xmalloc(sizeof(*kw));
+	kw->words = NULL;
+	kw->lens = NULL;
+	kw->len = kw->maxlen = kw->nstates = 0;
+	kw->next = NULL;
+	kw->out = NULL;
+	for (i = 0; i < LEN(kw->cache); i++) {
+		kw->cache[i].from = SIZE_MAX;
+		kw->cache[i].spans = NULL;
+	}
+	return kw;
+}
+
+static void
+kwfree(Keywords *kw)
+{
+	size_t i;
+
+	for (i = 0; i < kw->len; i++)
+		free(kw->words[i]);
+	for (i = 0; i < LEN(kw->cache); i++)
+		free(kw->cache[i].spans);
+	free(kw->words);
+	free(kw->lens);
+	free(kw->next);
+	free(kw->out);
+	free(kw);
+}
+
+/* Adds the len bytes of s to the keywords, taking ownership of s */
+static void
+kwadd(Keywords *kw, char *s, size_t len)
+{
+	size_t i;
+
+	kw->words = xrealloc(kw->words, (kw->len + 1) * sizeof(*kw->words));
+	kw->lens = xrealloc(kw->lens, (kw->len + 1) * sizeof(*kw->lens));
+	kw->words[kw->len] = s;
+	kw->lens[kw->len++] = len;
+	kw->maxlen = MAX(kw->maxlen, len);
+	kwbuild(kw);
+	for (i = 0; i < LEN(kw->cache); i++)
+		kw->cache[i].from = SIZE_MAX;
+}
+
+/*
+ * Builds the automaton for the keywords: first the trie of them, in which a
+ * transition to state zero means there is none, then the missing transitions
+ * and the outputs, breadth first, from those of the longest proper suffix of
+ * each state that is also in the trie.
+ */
+static void
+kwbuild(Keywords *kw)
+{
+	uint32_t *fail, *queue, st, t;
+	size_t i, j, n, head, tail;
+	unsigned char c;
+
+	for (n = 1, i = 0; i < kw->len; i++)
+		n += kw->lens[i];
+	kw->next = xrealloc(kw->next, n * sizeof(*kw->next));
+	kw->out = xrealloc(kw->out, n * sizeof(*kw->out));
+	memset(kw->next, 0, n * sizeof(*kw->next));
+	memset(kw->out, 0, n * sizeof(*kw->out));
+	kw->nstates = 1;
+	for (i = 0; i < kw->len; i++) {
+		for (st = j = 0; j < kw->lens[i]; j++) {
+			c = kw->words[i][j];
+			if (!kw->next[st][c])
+				kw->next[st][c] = kw->nstates++;
+			st = kw->next[st][c];
+		}
+		if (!kw->out[st])
+			kw->out[st] = i + 1;
+	}
+
+	fail = xmalloc(kw->nstates * sizeof(*fail));
+	queue = xmalloc(kw->nstates * sizeof(*queue));
+	head = tail = 0;
+	for (i = 0; i < 256; i++)
+		if ((t = kw->next[0][i])) {
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	while (head < tail) {
+		st = queue[head++];
+		for (i = 0; i < 256; i++) {
+			if (!(t = kw->next[st][i])) {
+				kw->next[st][i] = kw->next[fail[st]][i];
+				continue;
+			}
+			fail[t] = kw->next[fail[st]][i];
+			if (!kw->out[t])
+				kw->out[t] = kw->out[fail[t]];
+			queue[tail++] = t;
+		}
+	}
+	free(fail);
+	free(queue);
+}
+
+/*
+ * Finds the keywords overlapping the text between from and to, as triples of
+ * where each starts and ends and which keyword it is, in order. Where two
+ * overlap, the one starting first is shown in full. The triples stay in cache
+ * until the row from starts is pushed out of it, so they are not to be freed.
+ */
+static size_t
+kwspans(Keywords *kw, Buffer *buf, size_t from, size_t to, size_t **spans)
+{
+	size_t i, j, n, k, start, end, cap;
+	uint32_t st;
+
+	/* The top bits of the hash are the ones that depend on all of from */
+	i = (uint32_t)(from * 2654435761u) >> 24;
+	if (kw->cache[i].from == from && kw->cache[i].to == to) {
+		*spans = kw->cache[i].spans;
+		return kw->cache[i].n;
+	}
+
+	/* Keywords overlapping the ends start or end just beyond them */
+	start = from - MIN(from, kw->maxlen - 1);
+	end = MIN(to + kw->maxlen - 1, buf->textlen);
+	*spans = NULL;
+	n = cap = 0;
+	for (st = 0, j = start; j < end; j++) {
+		st = kw->next[st][(unsigned char)buf->text[j]];
+		if (!kw->out[st] || j + 1 <= from)
+			continue;
+		k = j + 1 - kw->lens[kw->out[st] - 1];
+		if (k >= to)
+			continue;
+
+		/* The keyword found leftmost wins, and then the longest */
+		while (n > 0 && (*spans)[3 * (n - 1)] >= k)
+			n--;
+		if (n > 0 && (*spans)[3 * (n - 1) + 1] > k)
+			k = (*spans)[3 * (n - 1) + 1];
+		if (n == cap) {
+			cap = MAX(2 * cap, 4);
+			*spans = xrealloc(*spans, 3 * cap * sizeof(**spans));
+		}
+		(*spans)[3 * n] = k;
+		(*spans)[3 * n + 1] = j + 1;
+		(*spans)[3 * n++ + 2] = kw->out[st] - 1;
+	}
+
+	/* A row whose keywords may yet run on into text not read is redone */
+	free(kw->cache[i].spans);
+	kw->cache[i].spans = *spans;
+	kw->cache[i].n = n;
+	kw->cache[i].from = end == to + kw->maxlen - 1 ? from : SIZE_MAX;
+	kw->cache[i].to = to;
+	return n;
+}
+
+/*
+ * Makes a pattern from the len bytes of s, which must be followed by a NUL,
+ * taking ownership of s. A string with any special characters in it is taken
+ * as an extended regular expression; if it doesn't compile as one, it is
+ * searched for as it stands.
+ */
+static Pattern *
+patnew(char *s, size_t len, Case mode)
+{
+	Pattern *pat;
+	Rune r;
+	char u[4];
+	size_t i, n, first, last;
+
+	pat = xmalloc(sizeof(*pat));
+	pat->src = pat->s = s;
+	pat->len = len;
+	pat->icase = mode != CASE_EXACT;
+	for (i = 0; mode == CASE_SMART && i < len; i += n) {
+		n = utfdecode(s + i, len - i, &r);
+		if (foldrune(r) != r)
+			pat->icase = 0;
+	}
+	pat->isregex = strpbrk(s, "\\.[(*+?{|^$") && !patcompile(pat);
+	if (pat->isregex)
+		pat->len = patrequired(s, &pat->s);
+	s = pat->s;
+	len = pat->len;
+
+	pat->fs = NULL;
+	pat->pair.at = SIZE_MAX;
+	pat->pair.ma = pat->pair.mb = 0;
+	if (len > 0 && !pat->icase) {
+		pat->pair.at = 0;
+		pat->pair.d = len - 1;
+		pat->pair.a = s[0];
+		pat->pair.b = s[len - 1];
+	} else if (pat->icase) {
+		/*
+		 * Folding never changes how long a rune is, so the folded string
+		 * is as long as the original. Only its ASCII bytes are sure to be
+		 * found at the same place in every match.
+		 */
+		pat->fs = xmalloc(len + 1);
+		for (i = 0; i < len; i += n) {
+			n = utfdecode(s + i, len - i, &r);
+			if (utfencode(u, foldrune(r)) != n)
+				memcpy(u, s + i, n); /* Part of a rune; keep it */
+			memcpy(pat->fs + i, u, n);
+		}
+		pat->fs[len] = '\0';
+		for (first = 0; first < len && pat->fs[first] & 0x80; first++)
+			;
+		for (last = len; last > first && pat->fs[last - 1] & 0x80; last--)
+			;
+		if (first < len) {
+			pat->pair.at = first;
+			pat->pair.d = last - 1 - first;
+			pat->pair.a = pat->fs[first];
+			pat->pair.b = pat->fs[last - 1];
+			pat->pair.ma = islower(pat->pair.a) ? 0x20 : 0;
+			pat->pair.mb = islower(pat->pair.b) ? 0x20 : 0;
+		}
+	}
+
+	for (i = 0; i < LEN(pat->skip); i++)
+		pat->skip[i] = pat->rskip[i] = MAX(len, 1);
+	for (i = 0; i + 1 < len; i++)
+		pat->skip[(unsigned char)s[i]] = len - 1 - i;
+	for (i = len; i-- > 1;)
+		pat->rskip[(unsigned char)s[i]] = i;
+	return pat;
+}
+
+static void
+patfree(Pattern *pat)
+{
+	if (pat->isregex)
+		regfree(&pat->re);
+	if (pat->s != pat->src)
+		free(pat->s);
+	free(pat->fs);
+	free(pat->src);
+	free(pat);
+}
+
+static int
+patcompile(Pattern *pat)
+{
+	int flags;
+
+	flags = REG_EXTENDED | REG_NEWLINE;
+	if (pat->icase)
+		flags |= REG_ICASE;
+	return regcomp(&pat->re, pat->src, flags);
+}
+
+/* Reports whether the pattern's string occurs at t */
+static int
+patequal(const Pattern *pat, const char *t)
+{
+	if (pat->icase)
+		return !foldcmp(t, pat->fs, pat->len);
+	return !memcmp(t, pat->s, pat->len);
+}
+
+/*
+ * Matches a regular expression against the text between from and to, which
+ * must not split a line. Offsets are kept relative to from, since regoff_t
+ * may be too narrow for the whole text.
+ */
+static int
+patmatch(const Pattern *pat, const char *text, size_t from, size_t to, size_t *start, size_t *end)
+{
+	regmatch_t m;
+	int flags, r;
+#ifndef REG_STARTEND
+	char *s;
+#endif
+
+	flags = from > 0 && text[from - 1] != '\n' ? REG_NOTBOL : 0;
+#ifdef REG_STARTEND
+	m.rm_so = 0;
+	m.rm_eo = to - from;
+	r = regexec(&pat->re, text + from, 1, &m, flags | REG_STARTEND);
+#else
+	s = xmalloc(to - from + 1);
+	memcpy(s, text + from, to - from);
+	s[to - from] = '\0';
+	r = regexec(&pat->re, s, 1, &m, flags);
+	free(s);
+#endif
+	if (r)
+		return 1;
+	*start = from + m.rm_so;
+	if (end)
+		*end = from + m.rm_eo;
+	return 0;
+}
+
+/*
+ * Finds the longest string that every match of an extended regular expression
+ * must contain, and stores a copy of it in *lit. Only atoms at the top level
+ * that are not optional are counted; a top level alternation means there is
+ * no such string.
+ */
+static size_t
+patrequired(const char *re, char **lit)
+{
+	const char *atom;
+	char *cur, c;
+	size_t i, j, n, len, alen, curlen, litlen;
+	int depth, optional, repeated;
+
+	len = strlen(re);
+	cur = xmalloc(len + 1);
+	*lit = xmalloc(len + 1);
+	curlen = litlen = 0;
+	for (i = 0; i < len; i += n) {
+		atom = NULL;
+		alen = 0;
+		n = 1;
+		switch (re[i]) {
+		case '|':
+			free(cur);
+			return 0;
+		case '\\':
+			if (i + 1 < len && ispunct((unsigned char)re[i + 1])) {
+				atom = re + i + 1;
+				alen = 1;
+			}
+			n = MIN(2, len - i);
+			break;
+		case '[':
+			j = i + 1;
+			if (j < len && re[j] == '^')
+				j++;
+			if (j < len && re[j] == ']')
+				j++;
+			for (; j < len && re[j] != ']'; j++) {
+				if (re[j] == '[' && j + 1 < len && strchr(":.=", re[j + 1])) {
+					c = re[++j];
+					while (++j + 1 < len && !(re[j] == c && re[j + 1] == ']'))
+						;
+					j++;
+				}
+			}
+			n = MIN(j + 1, len) - i;
+			break;
+		case '(':
+			for (depth = 0, j = i; j < len; j++) {
+				if (re[j] == '\\')
+					j++;
+				else if (re[j] == '(')
+					depth++;
+				else if (re[j] == ')' && --depth == 0)
+					break;
+			}
+			n = MIN(j + 1, len) - i;
+			break;
+		case '.': case '^': case '$': case '*': case '+': case '?': case '{':
+			break;
+		default:
+			atom = re + i;
+			alen = n = MIN(utfpeeklen(re[i]), len - i);
+		}
+
+		optional = repeated = 0;
+		while (i + n < len && strchr("*+?{", re[i + n])) {
+			if (re[i + n] == '{') {
+				optional |= re[i + n + 1] == '0' || re[i + n + 1] == ',';
+				while (i + n + 1 < len && re[i + n] != '}')
+					n++;
+			} else {
+				optional |= re[i + n] != '+';
+			}
+			repeated = 1;
+			n++;
+		}
+
+		if (atom && !optional) {
+			memcpy(cur + curlen, atom, alen);
+			curlen += alen;
+		}
+		if (!atom || optional || repeated) {
+			if (curlen > litlen)
+				memcpy(*lit, cur, litlen = curlen);
+			curlen = 0;
+		}
+	}
+	if (curlen > litlen)
+		memcpy(*lit, cur, litlen = curlen);
+	free(cur);
+	return litlen;
+}
+
+static Search *
+srchnew(Buffer *buf, Pattern *pat)
+{
+	Search *s;
+
+	s = xmalloc(sizeof(*s));
+	s->buf = buf;
+	s->pat = pat;
+	s->len = s->end = 0;
+	s->cur = s->near = SIZE_MAX;
+	s->keep = 0;
+	s->cap = 16;
+	s->hits = xmalloc(s->cap * sizeof(*s->hits));
+	s->cand.keys = NULL;
+	s->cand.nkeys = SIZE_MAX;
+	s->cand.pos = s->cand.next = NULL;
+	s->cand.count = NULL;
+	s->cand.len = 0;
+	s->stop = 0;
+	return s;
+}
+
+static void
+srchfree(Search *s)
+{
+	size_t i;
+
+	pthread_mutex_lock(&poollock);
+	s->stop = 1;
+	pthread_mutex_unlock(&poollock);
+	for (i = 0; i < s->len; i++) {
+		poolwait(&s->hits[i]->pending);
+		free(s->hits[i]->offs);
+		free(s->hits[i]->ends);
+		free(s->hits[i]);
+	}
+	free(s->hits);
+	free(s->cand.keys);
+	free(s->cand.pos);
+	free(s->cand.next);
+	free(s->cand.count);
+	patfree(s->pat);
+	free(s);
+}
+
+/*
+ * Finds the last match starting before off. Text past the end of the search,
+ * which can only be a line still being read, is searched directly.
+ */
+static int
+srchbackwards(Search *s, size_t off, size_t *found)
+{
+	Hits *h;
+	size_t i, lo;
+
+	srchextend(s, 0, off);
+	if (off > s->end)
+		return bufsearchbackwards(s->buf, s->pat, off, found);
+	if (off == 0)
+		return 1;
+
+	for (i = srchfind(s, off - 1) + 1; i-- > 0;) {
+		h = s->hits[i];
+		hitsload(h);
+		if ((lo = hitsfind(h, off)) > 0) {
+			*found = h->offs[lo - 1];
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+srchchunk(void *arg)
+{
+	Hits *h;
+	int stop;
+
+	h = arg;
+	pthread_mutex_lock(&poollock);
+	stop = h->srch->stop;
+	pthread_mutex_unlock(&poollock);
+	if (stop)
+		return;
+	hitsscan(h);
+	hitsdone(h);
+}
+
+/*
+ * Counts the matches found so far, and how many of them start at or before
+ * off; nth is SIZE_MAX if that isn't known yet. Returns whether every match
+ * in the text read so far has been counted.
+ */
+static int
+srchcount(Search *s, size_t off, size_t *total, size_t *nth)
+{
+	Hits *h;
+	size_t i;
+	int done;
+
+	*total = 0;
+	*nth = 0;
+	done = s->end == s->buf->textlen;
+	pthread_mutex_lock(&poollock);
+	for (i = 0; i < s->len; i++) {
+		h = s->hits[i];
+		if (h->pending) {
+			done = 0;
+			if (h->from <= off)
+				*nth = SIZE_MAX;
+			continue;
+		}
+		*total += h->len;
+		if (*nth == SIZE_MAX || h->from > off)
+			continue;
+		if (h->to <= off)
+			*nth += h->len;
+		else if (h->len > 0 && !h->offs)
+			*nth = SIZE_MAX;
+		else
+			*nth += hitsfind(h, off + 1);
+	}
+	pthread_mutex_unlock(&poollock);
+	return done;
+}
+
+/*
+ * Extends the search to the text read so far, handing the new chunks to the
+ * workers nearest the given offset first. Unless the text is final, its last
+ * line is left out, since matches must not be cut off by the end of the text.
+ * Where the text has been indexed, chunks are made of the blocks that might
+ * hold a match, and the rest is passed over.
+ */
+static void
+srchextend(Search *s, int final, size_t near)
+{
+	Hits *h;
+	size_t from, to, end, first, covered, n, b;
+
+	pthread_mutex_lock(&poollock);
+	s->near = near;
+	pthread_mutex_unlock(&poollock);
+	end = final ? s->buf->textlen : buflinestart(s->buf, s->buf->textlen);
+	if (end <= s->end)
+		return;
+
+	covered = 0;
+	if (textindex && (n = idxcandidates(textindex, s->pat, &s->cand)) > 0)
+		covered = textindex->blocks[n - 1]->to;
+
+	first = s->len;
+	for (from = s->end; from < end; from = to) {
+		if (from < covered) {
+			b = idxfind(textindex, from);
+			to = MIN(textindex->blocks[b]->to, end);
+			if (s->cand.count[b] != s->cand.nkeys)
+				continue;
+		} else {
+			to = buflinenext(s->buf, from + CHUNKSIZE, end);
+		}
+		if (s->len == s->cap) {
+			s->cap *= 2;
+			s->hits = xrealloc(s->hits, s->cap * sizeof(*s->hits));
+		}
+		h = s->hits[s->len++] = xmalloc(sizeof(*h));
+		h->srch = s;
+		h->from = from;
+		h->to = to;
+		h->offs = h->ends = NULL;
+		h->len = h->cap = 0;
+		h->pending = 1;
+		h->task.func = srchchunk;
+		h->task.arg = h;
+		h->task.pending = &h->pending;
+	}
+	s->end = end;
+	srchsubmit(s, first, near);
+}
+
+/* Returns the index of the chunk holding off, or the number of chunks */
+static size_t
+srchfind(Search *s, size_t off)
+{
+	size_t lo, hi, mid;
+
+	for (lo = 0, hi = s->len; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (s->hits[mid]->to <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Returns the index of the first match in the chunk starting at or after off */
+static size_t
+hitsfind(const Hits *h, size_t off)
+{
+	size_t lo, hi, mid;
+
+	for (lo = 0, hi = h->len; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (h->offs[mid] < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Called on a chunk once it has been searched. Unless it lies near where the
+ * search is looked at, only the count of its matches is kept, so that counting
+ * a large input doesn't hold on to every match in it.
+ */
+static void
+hitsdone(Hits *h)
+{
+	Search *s;
+	int far;
+
+	s = h->srch;
+	pthread_mutex_lock(&poollock);
+	far = !s->keep && (s->near == SIZE_MAX || h->to + CHUNKSIZE <= s->near ||
+	                   s->near + CHUNKSIZE < h->from);
+	pthread_mutex_unlock(&poollock);
+	if (far)
+		hitsdrop(h);
+}
+
+/* Lets go of the matches of a chunk, keeping only their count */
+static void
+hitsdrop(Hits *h)
+{
+	free(h->offs);
+	free(h->ends);
+	h->offs = h->ends = NULL;
+	h->cap = 0;
+}
+
+/*
+ * Waits for a chunk to be searched, and searches it again if it has only kept
+ * the count of its matches
+ */
+static void
+hitsload(Hits *h)
+{
+	poolwait(&h->pending);
+	if (h->len > 0 && !h->offs)
+		hitsscan(h);
+}
+
+/* Searches the text of a chunk for its matches */
+static void
+hitsscan(Hits *h)
+{
+	Search *s;
+	Pattern pat;
+	size_t off, found, end, empty;
+	const char *nl;
+
+	s = h->srch;
+	h->len = 0;
+
+	/* A compiled regex can't be used by several threads at once */
+	pat = *s->pat;
+	if (pat.isregex && patcompile(&pat))
+		return;
+
+	/*
+	 * Strings may overlap, as the matches of a longer string have to be
+	 * among those of its prefix for srchnarrow, but regular expressions
+	 * carry on after the end of each match, as with grep -o. Of the empty
+	 * matches, only the first on each line is kept, so that ^ finds every
+	 * line but x* doesn't find every byte.
+	 */
+	pthread_rwlock_rdlock(&s->buf->lock);
+	for (off = h->from, empty = 0; !bufsearchforwards(s->buf, &pat, off, h->to, &found, &end);) {
+		if (found == h->to)
+			break; /* An empty match here is the next chunk's */
+		if (!pat.isregex)
+			off = found + 1;
+		else if (end > found)
+			off = end;
+		else
+			off = end + (end < h->to ? utfpeeklen(s->buf->text[end]) : 1);
+		if (pat.isregex && end == found) {
+			if (found < empty)
+				continue;
+			nl = memchr(s->buf->text + found, '\n', h->to - found);
+			empty = nl ? (size_t)(nl - s->buf->text) + 1 : h->to;
+		}
+		if (h->len == h->cap) {
+			h->cap = MAX(2 * h->cap, 64);
+			h->offs = xrealloc(h->offs, h->cap * sizeof(*h->offs));
+			if (pat.isregex)
+				h->ends = xrealloc(h->ends, h->cap * sizeof(*h->ends));
+		}
+		if (pat.isregex)
+			h->ends[h->len] = end;
+		h->offs[h->len++] = found;
+	}
+	pthread_rwlock_unlock(&s->buf->lock);
+	if (pat.isregex)
+		regfree(&pat.re);
+}
+
+/*
+ * Finds the first match starting at or after off in the text read so far,
+ * waiting for the chunks in the way to be searched
+ */
+static int
+srchforwards(Search *s, size_t off, int final, size_t *found)
+{
+	Hits *h;
+	size_t i, lo;
+
+	srchextend(s, final, off);
+	for (i = srchfind(s, off); i < s->len; i++) {
+		h = s->hits[i];
+		hitsload(h);
+		if ((lo = hitsfind(h, off)) < h->len) {
+			*found = h->offs[lo];
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Makes a search for a string that starts with the one prev searched for, and
+ * frees prev. Its matches must be among those of prev, so the chunks prev has
+ * searched hand theirs over to be checked. The rest are searched afresh, so
+ * that narrowing a search that has only just started doesn't wait for it to
+ * cover the whole text.
+ */
+static Search *
+srchnarrow(Search *prev, Pattern *pat)
+{
+	Search *s;
+	Hits *h, *base;
+	size_t i;
+	int done;
+
+	s = srchnew(prev->buf, pat);
+	s->cap = MAX(prev->len, 1);
+	s->hits = xrealloc(s->hits, s->cap * sizeof(*s->hits));
+	for (i = 0; i < prev->len; i++) {
+		base = prev->hits[i];
+		pthread_mutex_lock(&poollock);
+		done = base->pending == 0 && (base->offs || base->len == 0);
+		pthread_mutex_unlock(&poollock);
+		h = s->hits[i] = xmalloc(sizeof(*h));
+		h->srch = s;
+		h->from = base->from;
+		h->to = base->to;
+		h->offs = h->ends = NULL;
+		h->len = h->cap = 0;
+		if (done) {
+			h->offs = base->offs;
+			h->len = base->len;
+			h->cap = base->cap;
+			base->offs = NULL;
+		}
+		h->pending = 1;
+		h->task.func = done ? srchnarrowchunk : srchchunk;
+		h->task.arg = h;
+		h->task.pending = &h->pending;
+	}
+	s->len = prev->len;
+	s->end = prev->end;
+	s->near = searchorigin;
+	srchfree(prev);
+	srchsubmit(s, 0, searchorigin);
+	return s;
+}
+
+/* Drops the matches a chunk took over from a shorter string that don't match */
+static void
+srchnarrowchunk(void *arg)
+{
+	Hits *h;
+	Search *s;
+	size_t i, n, off;
+	int stop;
+
+	h = arg;
+	s = h->srch;
+	pthread_mutex_lock(&poollock);
+	stop = s->stop;
+	pthread_mutex_unlock(&poollock);
+	if (stop)
+		return;
+
+	pthread_rwlock_rdlock(&s->buf->lock);
+	for (i = n = 0; i < h->len; i++) {
+		off = h->offs[i];
+		if (h->to - off >= s->pat->len && patequal(s->pat, s->buf->text + off))
+			h->offs[n++] = off;
+	}
+	h->len = n;
+	pthread_rwlock_unlock(&s->buf->lock);
+	hitsdone(h);
+}
+
+/*
+ * Returns where the match starting at off ends. A match past the end of the
+ * search is taken to be as long as the string searched for.
+ */
+static size_t
+srchend(Search *s, size_t off)
+{
+	Hits *h;
+	size_t i, lo;
+
+	if ((i = srchfind(s, off)) < s->len && (h = s->hits[i])->from <= off) {
+		hitsload(h);
+		lo = hitsfind(h, off);
+		if (lo < h->len && h->offs[lo] == off && h->ends)
+			return h->ends[lo];
+	}
+	return off + s->pat->len;
+}
+
+/*
+ * Collects the matches overlapping the text between from and to, as pairs of
+ * start and end offsets in order of start, and returns how many there are.
+ * Only text the search has been extended to is covered.
+ */
+static size_t
+srchspans(Search *s, size_t from, size_t to, size_t **spans)
+{
+	Hits *h;
+	size_t i, j, n, cap, first, end;
+
+	n = 0;
+	cap = 16;
+	*spans = xmalloc(2 * cap * sizeof(**spans));
+	/* Matches don't span lines, so none overlapping from starts further back */
+	first = buflinestart(s->buf, from);
+	for (i = srchfind(s, first); i < s->len && s->hits[i]->from < to; i++) {
+		h = s->hits[i];
+		hitsload(h);
+		for (j = hitsfind(h, first); j < h->len && h->offs[j] < to; j++) {
+			end = h->ends ? h->ends[j] : h->offs[j] + s->pat->len;
+			if (end <= from)
+				continue;
+			if (n == cap) {
+				cap *= 2;
+				*spans = xrealloc(*spans, 2 * cap * sizeof(**spans));
+			}
+			(*spans)[2 * n] = h->offs[j];
+			(*spans)[2 * n++ + 1] = end;
+		}
+	}
+	return n;
+}
+
+/*
+ * Returns the search for the text of the prompt, which is s if the text
+ * hasn't changed since. Otherwise, s is freed and a new search started.
+ */
+static Search *
+srchupdate(Search *s, Buffer *buf, Prompt *p)
+{
+	Pattern *pat;
+	char *str;
+	size_t len;
+
+	str = promptutf8(p, &len);
+	if (s && !strcmp(str, s->pat->src)) {
+		free(str);
+		return s;
+	}
+	pat = patnew(str, len, casemode);
+	if (s && !s->pat->isregex && !pat->isregex && s->pat->len > 0 &&
+	    pat->len > s->pat->len && !memcmp(pat->s, s->pat->s, s->pat->len) &&
+	    (s->pat->icase || !pat->icase))
+		return srchnarrow(s, pat);
+	if (s)
+		srchfree(s);
+	return srchnew(buf, pat);
+}
+
+/* Hands the chunks from first on to the workers, nearest the given offset first */
+static void
+srchsubmit(Search *s, size_t first, size_t near)
+{
+	size_t i, j;
+
+	if (first >= s->len)
+		return;
+	i = MAX(srchfind(s, near), first);
+	i = MIN(i, s->len - 1);
+	for (j = i; i < s->len || j > first;) {
+		if (i < s->len)
+			poolsubmit(&s->hits[i++]->task);
+		if (j > first)
+			poolsubmit(&s->hits[--j]->task);
+	}
+}
+
+static Filter *
+filtnew(Search *s, int (*stop)(void))
+{
+	Filter *f;
+
+	f = xmalloc(sizeof(*f));
+	f->srch = s;
+	s->keep = 1; /* Chunks let go of their matches once lines are picked out */
+	f->stop = stop;
+	f->len = f->next = f->top = 0;
+	f->cap = 64;
+	f->lines = xmalloc(f->cap * sizeof(*f->lines));
+	return f;
+}
+
+static void
+filtfree(Filter *f)
+{
+	srchfree(f->srch);
+	free(f->lines);
+	free(f);
+}
+
+static Window *
+winnew(size_t rows, size_t cols)
+{
+	Window *win;
+	size_t i;
+
+	win = xmalloc(sizeof(*win));
+	for (i = 0; i < LEN(win->cache); i++)
+		win->cache[i] = NULL;
+	win->buf = bufnew();
+	win->lay = laynew(chop ? SIZE_MAX : cols, 0);
+	win->rows = rows;
+	win->cols = cols;
+	win->row = win->anchor = win->hoff = 0;
+	win->hex = 0;
+	win->hexoff = 0;
+	win->filter = NULL;
+	return win;
+}
+
+static void
+winfree(Window *win)
+{
+	size_t i;
+
+	for (i = 0; i < LEN(win->cache); i++)
+		if (win->cache[i])
+			layfree(win->cache[i]);
+	layfree(win->lay);
+	if (win->filter)
+		filtfree(win->filter);
+	buffree(win->buf);
+	free(win);
+}
+
+/* Lays out the text between the end of the layout and to, a line start */
+static void
+winappend(Window *win, size_t to)
+{
+	Layout *lay;
+	size_t *rows, n;
+
+	lay = win->lay;
+	if (to <= lay->end)
+		return;
+
+	rows = buflayout(win->buf, lay->end, to, lay->width, &n);
+	layreserve(lay, 0, n);
+	memcpy(lay->rows + lay->len, rows, n * sizeof(*rows));
+	lay->len += n;
+	lay->end = to;
+	free(rows);
+}
+
+/* Shows only the lines picked out by f, or all of them if f is null */
+static void
+winfilter(Window *win, Filter *f, Input *in)
+{
+	if (win->filter)
+		filtfree(win->filter);
+	win->filter = f;
+	winseek(win, win->anchor, in);
+}
+
+/*
+ * Moves from the row starting at pos, in the given line of the filter, to the
+ * next row shown. Returns 1 if there is none.
+ */
+static int
+winfilterdown(Window *win, size_t *line, size_t *pos, Input *in)
+{
+	size_t next;
+
+	if (*line >= win->filter->len)
+		return 1;
+	next = bufrowend(win->buf, *pos, win->lay->width, 1);
+	if (next < win->buf->textlen && win->buf->text[next - 1] != '\n') {
+		*pos = next;
+		return 0;
+	}
+	if (winfilterfill(win, *line + 1, in))
+		return 1;
+	*pos = win->filter->lines[++*line];
+	return 0;
+}
+
+/*
+ * Reads ahead about *ahead bytes of input for a search, unless stop says to
+ * stop first. The amount is doubled for the next time, up to a limit, so that
+ * the workers have more and more to search at once. Returns 1 at the end of
+ * the input.
+ */
+static int
+winreadahead(Window *win, Input *in, size_t *ahead, int (*stop)(void))
+{
+	enum { MAXAHEAD = 1 << 24 };
+	size_t end;
+	int final;
+
+	final = 0;
+	for (end = win->buf->textlen + *ahead; win->buf->textlen < end;)
+		if ((final = bufread(win->buf, in)) || (stop && stop()))
+			break;
+	*ahead = MIN(2 * *ahead, MAXAHEAD);
+	return final;
+}
+
+/*
+ * Picks lines out of the search until the filter has line n, reading more
+ * input as needed with winreadahead. Returns 1 if there aren't that many
+ * lines, or if the filter's stop says so before more text is searched, so
+ * that what has been found can be shown.
+ */
+static int
+winfilterfill(Window *win, size_t n, Input *in)
+{
+	Filter *f;
+	Search *s;
+	Hits *h;
+	size_t i, end, ahead;
+
+	f = win->filter;
+	s = f->srch;
+	for (ahead = BUFSIZ; f->len <= n;) {
+		if (f->next < s->len) {
+			h = s->hits[f->next++];
+			hitsload(h);
+			for (i = 0, end = 0; i < h->len; i++) {
+				if (h->offs[i] < end)
+					continue;
+				if (f->len == f->cap) {
+					f->cap *= 2;
+					f->lines = xrealloc(f->lines, f->cap * sizeof(*f->lines));
+				}
+				f->lines[f->len++] = buflinestart(win->buf, h->offs[i]);
+				end = buflineend(win->buf, h->offs[i]) + 1;
+			}
+			hitsdrop(h);
+		} else if (f->stop && f->stop()) {
+			return 1;
+		} else if (inputatend(in)) {
+			if (s->end == win->buf->textlen)
+				return 1;
+			srchextend(s, 1, s->end);
+		} else {
+			srchextend(s, winreadahead(win, in, &ahead, f->stop), s->end);
+		}
+	}
+	return 0;
+}
 
-	while (bufsearchforwards(win->buf, s, len, row, &row)) {
-		row = win->buf->len - 1;
+/*
+ * Returns the index of the first line of the filter that doesn't end before
+ * off, or the number of lines if there is none
+ */
+static size_t
+winfilterfind(Window *win, size_t off, Input *in)
+{
+	Filter *f;
+	size_t lo, hi, mid;
+
+	f = win->filter;
+	while ((f->len == 0 || f->lines[f->len - 1] <= off) && !winfilterfill(win, f->len, in))
+		;
+	for (lo = 0, hi = f->len; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (f->lines[mid] <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0 && buflineend(win->buf, f->lines[lo - 1]) >= off)
+		return lo - 1;
+	return lo;
+}
+
+/* Puts the row holding off, in the given line of the filter, on top */
+static void
+winfilterrow(Window *win, size_t line, size_t off)
+{
+	size_t pos, next;
+
+	pos = win->filter->lines[line];
+	while ((next = bufrowend(win->buf, pos, win->lay->width, 1)) <= off &&
+	       next < win->buf->textlen && win->buf->text[next - 1] != '\n')
+		pos = next;
+	win->filter->top = line;
+	win->anchor = pos;
+}
+
+/*
+ * Moves from the row starting at pos, in the given line of the filter, to the
+ * row shown before it. Returns 1 if there is none.
+ */
+static int
+winfilterup(Window *win, size_t *line, size_t *pos)
+{
+	size_t off, end, next;
+
+	if (*line >= win->filter->len || (*pos == win->filter->lines[*line] && *line == 0))
+		return 1;
+	if (*pos == win->filter->lines[*line]) {
+		off = win->filter->lines[--*line];
+		end = buflineend(win->buf, off);
+		end += end < win->buf->textlen;
+	} else {
+		off = win->filter->lines[*line];
+		end = *pos;
+	}
+	while ((next = bufrowend(win->buf, off, win->lay->width, 1)) < end)
+		off = next;
+	*pos = off;
+	return 0;
+}
+
+static int
+wingetline(Window *win, Input *in)
+{
+	Layout *lay;
+	size_t end;
+
+	lay = win->lay;
+	while ((end = bufrowend(win->buf, lay->end, lay->width, inputatend(in))) == SIZE_MAX)
+		bufread(win->buf, in);
+	if (end == lay->end)
+		return 1;
+
+	layreserve(lay, 0, 1);
+	lay->rows[lay->len++] = lay->end;
+	lay->end = end;
+	return 0;
+}
+
+static void
+winhexseek(Window *win, off_t off, Input *in)
+{
+	off_t rowlen, last;
+	char c;
+
+	rowlen = hexrowlen(win->cols);
+	off -= off % rowlen;
+	if (off > 0 && !inputreadat(in, off + (win->rows - 1) * rowlen, &c, 1)) {
+		last = (inputsize(in) + rowlen - 1) / rowlen - win->rows;
+		off = last > 0 ? last * rowlen : 0;
+	}
+	win->hexoff = off;
+}
+
+/*
+ * Lays out whole lines before the start of the layout until at least the
+ * given number of rows have been added, or the start of the text is reached.
+ * Returns the number of rows added.
+ */
+static size_t
+winprepend(Window *win, size_t rows)
+{
+	Layout *lay;
+	size_t added, start, off, n, i, *rowsbefore;
+
+	lay = win->lay;
+	added = 0;
+	if (rows == SIZE_MAX && (start = laystart(lay)) > 0) {
+		/* Everything before the layout is wanted, so do it all at once */
+		rowsbefore = buflayout(win->buf, 0, start, lay->width, &added);
+		layreserve(lay, added, 0);
+		lay->rows -= added;
+		lay->len += added;
+		memcpy(lay->rows, rowsbefore, added * sizeof(*rowsbefore));
+		free(rowsbefore);
+	}
+	while (added < rows && (start = laystart(lay)) > 0) {
+		off = buflinestart(win->buf, start - 1);
+		for (n = 0, i = off; i < start; n++)
+			i = bufrowend(win->buf, i, lay->width, 1);
+
+		layreserve(lay, n, 0);
+		lay->rows -= n;
+		lay->len += n;
+		for (i = 0; i < n; i++) {
+			lay->rows[i] = off;
+			off = bufrowend(win->buf, off, lay->width, 1);
+		}
+		added += n;
+	}
+	return added;
+}
+
+/*
+ * Collects the rows on screen into an allocated array, as pairs of offsets
+ * where each starts and ends. Returns the number of rows.
+ */
+static size_t
+winrows(Window *win, size_t **rows, Input *in)
+{
+	Layout *lay;
+	size_t n, i, line, pos;
+
+	*rows = xmalloc(2 * MAX(win->rows, 1) * sizeof(**rows));
+	n = 0;
+	if (win->filter) {
+		line = win->filter->top;
+		pos = win->anchor;
+		while (n < win->rows && line < win->filter->len) {
+			(*rows)[2 * n] = pos;
+			(*rows)[2 * n++ + 1] = bufrowend(win->buf, pos, win->lay->width, 1);
+			if (n < win->rows && winfilterdown(win, &line, &pos, in))
+				break;
+		}
+		return n;
+	}
+
+	lay = win->lay;
+	if (win->row < win->rows)
+		win->row = MIN(win->rows, lay->len);
+	for (i = win->row >= win->rows ? win->row - win->rows : 0; i < win->row; i++) {
+		(*rows)[2 * n] = lay->rows[i];
+		(*rows)[2 * n++ + 1] = layrowend(lay, i);
+	}
+	return n;
+}
+
+/*
+ * The new layout starts at the line on top of the screen, so only the rows
+ * that are about to be shown are laid out here. Everything else is laid out
+ * when it is scrolled to. The anchor is left alone, so that going back to an
+ * earlier size shows exactly what was shown before. Chopped lines don't
+ * depend on the width at all, so then the layout is kept.
+ */
+static void
+winresize(Window *win, size_t rows, size_t cols, Input *in)
+{
+	size_t width;
+
+	win->rows = rows;
+	win->cols = cols;
+
+	width = chop ? SIZE_MAX : cols;
+	if (win->lay->width != width)
+		winsetwidth(win, width);
+	winseek(win, win->anchor, in);
+
+	if (win->hex)
+		winhexseek(win, win->hexoff, in);
+}
+
+/*
+ * Scrolls chopped lines sideways so that the text between from and to, which
+ * is within a line, is on screen, or as much of it as fits from the start.
+ * Wrapped lines are always on screen in full.
+ */
+static void
+winreveal(Window *win, size_t from, size_t to)
+{
+	size_t start, end, hoff;
+
+	if (win->lay->width != SIZE_MAX)
+		return;
+	start = bufcolumn(win->buf, from);
+	end = MAX(bufcolumn(win->buf, to), start + 1);
+	if (start >= win->hoff && end <= win->hoff + win->cols)
+		return;
+
+	/* Staying on a tab stop keeps tabs lined up, as in winscrollright */
+	hoff = end > win->cols ? (end - win->cols + TABWIDTH - 1) / TABWIDTH * TABWIDTH : 0;
+	win->hoff = hoff <= start ? hoff : start / TABWIDTH * TABWIDTH;
+}
+
+static void
+winscrollbot(Window *win, Input *in)
+{
+	Filter *f;
+
+	if (win->hex) {
+		winhexseek(win, inputsize(in), in);
+		return;
+	}
+	while (!bufread(win->buf, in))
+		;
+	if (win->filter) {
+		f = win->filter;
+		winfilterfill(win, SIZE_MAX - 1, in);
+		if (f->len == 0)
+			return;
+		f->top = f->len - 1;
+		win->anchor = f->lines[f->top];
+		while (!winfilterdown(win, &f->top, &win->anchor, in))
+			;
+		winscrollup(win, win->rows - 1, in);
+		return;
+	}
+	winappend(win, buflinestart(win->buf, win->buf->textlen));
+	while (!wingetline(win, in))
+		;
+	win->row = win->lay->len;
+	winsetanchor(win);
+}
+
+static void
+winscrolldown(Window *win, size_t lines, Input *in)
+{
+	size_t i, line, pos;
+
+	if (win->hex) {
+		winhexseek(win, win->hexoff + (off_t)lines * hexrowlen(win->cols), in);
+		return;
+	} else if (win->filter) {
+		/* The bottom row leads, so that the screen stays full */
+		line = win->filter->top;
+		pos = win->anchor;
+		for (i = 1; i < win->rows && !winfilterdown(win, &line, &pos, in); i++)
+			;
+		for (; i == win->rows && lines > 0 && !winfilterdown(win, &line, &pos, in); lines--)
+			winfilterdown(win, &win->filter->top, &win->anchor, in);
+		return;
+	}
+	while (win->lay->len < win->row + lines) {
 		if (wingetline(win, in))
+			break;
+	}
+
+	win->row += lines;
+	if (win->row > win->lay->len)
+		win->row = win->lay->len;
+	winsetanchor(win);
+}
+
+static void
+winscrollleft(Window *win, size_t cols)
+{
+	/* Staying on a tab stop keeps tabs lined up */
+	cols = MAX(cols / TABWIDTH, 1) * TABWIDTH;
+	win->hoff = cols > win->hoff ? 0 : win->hoff - cols;
+}
+
+static void
+winscrollright(Window *win, size_t cols)
+{
+	if (!chop)
+		return;
+	win->hoff += MAX(cols / TABWIDTH, 1) * TABWIDTH;
+}
+
+static void
+winscrolltop(Window *win, Input *in)
+{
+	win->hexoff = 0;
+	if (win->filter) {
+		winseek(win, 0, in);
+		return;
+	}
+	winprepend(win, SIZE_MAX);
+	win->row = MIN(win->rows, win->lay->len);
+	winsetanchor(win);
+}
+
+static void
+winscrollup(Window *win, size_t lines, Input *in)
+{
+	size_t top;
+	off_t off;
+
+	if (win->hex) {
+		off = (off_t)lines * hexrowlen(win->cols);
+		winhexseek(win, off > win->hexoff ? 0 : win->hexoff - off, in);
+		return;
+	} else if (win->filter) {
+		for (; lines > 0 && !winfilterup(win, &win->filter->top, &win->anchor); lines--)
+			;
+		return;
+	}
+
+	top = win->row >= win->rows ? win->row - win->rows : 0;
+	if (lines > top)
+		win->row += winprepend(win, lines - top);
+	win->row = lines > win->row ? 0 : win->row - lines;
+	if (win->row < win->rows)
+		win->row = MIN(win->rows, win->lay->len);
+	winsetanchor(win);
+}
+
+/*
+ * Searches backwards from the top of the screen. When lines are filtered,
+ * matches in lines that aren't shown are passed over.
+ */
+static void
+winsearchbackwards(Window *win, Search *s, Input *in)
+{
+	Layout *lay;
+	size_t top, off, row, i;
+
+	if (win->filter) {
+		for (off = win->anchor; !srchbackwards(s, off, &off);) {
+			i = winfilterfind(win, off, in);
+			if (i < win->filter->len && win->filter->lines[i] <= off) {
+				s->cur = off;
+				winreveal(win, off, srchend(s, off));
+				winseek(win, off, in);
+				return;
+			} else if (i == 0) {
+				return;
+			}
+			off = buflineend(win->buf, win->filter->lines[i - 1]);
+		}
+		return;
+	}
+
+	lay = win->lay;
+	if (win->row == 0 || lay->len == 0)
+		return;
+
+	top = win->row >= win->rows ? win->row - win->rows : 0;
+	if (srchbackwards(s, lay->rows[top], &off))
+		return;
+	s->cur = off;
+	winreveal(win, off, srchend(s, off));
+
+	while (off < laystart(lay))
+		winprepend(win, 1);
+
+	row = layfind(lay, off);
+	win->row = MIN(row + win->rows, lay->len);
+	winsetanchor(win);
+}
+
+/*
+ * Searches forwards from the end of the screen. If the match isn't in the
+ * text read so far, more is read with winreadahead. The search is given up if
+ * stop says so before more is read. When lines are filtered, the search skips
+ * ahead to the next line shown whenever a match is in one that isn't.
+ */
+static void
+winsearchforwards(Window *win, Search *s, Input *in, int (*stop)(void))
+{
+	Filter *f;
+	Layout *lay;
+	size_t from, off, row, ahead, line, i;
+	int final;
+
+	f = win->filter;
+	lay = win->lay;
+	if (f) {
+		line = f->top;
+		off = win->anchor;
+		for (i = 1; i < win->rows && !winfilterdown(win, &line, &off, in); i++)
+			;
+		if (line >= f->len)
+			return;
+		from = bufrowend(win->buf, off, lay->width, 1);
+	} else if (win->row == 0 || lay->len == 0) {
+		return;
+	} else {
+		from = layrowend(lay, win->row - 1);
+	}
+
+	final = inputatend(in);
+	for (ahead = BUFSIZ;;) {
+		if (!srchforwards(s, from, final, &off)) {
+			if (!f)
+				break;
+			if ((i = winfilterfind(win, off, in)) == f->len)
+				return;
+			if (f->lines[i] <= off)
+				break;
+			from = f->lines[i];
+			continue;
+		}
+		if (final || (stop && stop()))
 			return;
+		final = winreadahead(win, in, &ahead, stop);
 	}
+
+	s->cur = off;
+	winreveal(win, off, srchend(s, off));
+	if (f) {
+		winfilterrow(win, i, off);
+		winscrollup(win, win->rows - 1, in);
+		return;
+	}
+	winappend(win, buflinestart(win->buf, off));
+	while (lay->end <= off)
+		if (wingetline(win, in))
+			break;
+	row = layfind(lay, off);
 	win->row = row + 1;
+	winsetanchor(win);
+}
+
+/*
+ * Moves the window so that the row holding off is at the top, or as close to
+ * it as the end of the text allows. When lines are filtered and the line of
+ * off isn't shown, the next line that is goes on top.
+ */
+static void
+winseek(Window *win, size_t off, Input *in)
+{
+	Filter *f;
+	size_t top, i, line, pos;
+
+	if ((f = win->filter)) {
+		win->anchor = off;
+		if ((i = winfilterfind(win, off, in)) == f->len) {
+			if (f->len == 0)
+				return;
+			i = f->len - 1;
+		}
+		winfilterrow(win, i, MAX(off, f->lines[i]));
+		line = f->top;
+		pos = win->anchor;
+		for (i = 1; i < win->rows && !winfilterdown(win, &line, &pos, in); i++)
+			;
+		winscrollup(win, win->rows - i, in);
+		return;
+	}
+
+	win->anchor = off;
+	while (off < laystart(win->lay))
+		winprepend(win, 1);
+	while (win->lay->end <= off && !wingetline(win, in))
+		;
+	top = layfind(win->lay, off);
+
+	win->row = top + win->rows;
+	while (win->lay->len < win->row && !wingetline(win, in))
+		;
+	if (win->row > win->lay->len)
+		win->row = win->lay->len;
+	if (win->row < win->rows)
+		win->row += winprepend(win, win->rows - win->row);
+}
+
+/*
+ * Switches to a layout of the given width, taking it from the cache if there
+ * is one. A cached layout is only worth extending to the anchor if it isn't
+ * too far away; otherwise, a new layout is started there.
+ */
+static void
+winsetwidth(Window *win, size_t width)
+{
+	enum { REUSELIMIT = 1 << 20 };
+	Layout *lay;
+	size_t i, n;
+
+	n = LEN(win->cache);
+	for (i = 0; i < n && !(win->cache[i] && win->cache[i]->width == width); i++)
+		;
+	if (i < n) {
+		lay = win->cache[i];
+	} else {
+		lay = NULL;
+		if (n > 0 && win->cache[--i])
+			layfree(win->cache[i]);
+	}
+	if (n > 0) {
+		memmove(win->cache + 1, win->cache, i * sizeof(*win->cache));
+		win->cache[0] = win->lay;
+	} else {
+		layfree(win->lay);
+	}
+
+	if (lay && (win->anchor + REUSELIMIT < laystart(lay) || lay->end + REUSELIMIT < win->anchor)) {
+		layfree(lay);
+		lay = NULL;
+	}
+	win->lay = lay ? lay : laynew(width, buflinestart(win->buf, win->anchor));
+}
+
+static void
+winsetanchor(Window *win)
+{
+	size_t top;
+
+	top = win->row >= win->rows ? win->row - win->rows : 0;
+	win->anchor = top < win->lay->len ? win->lay->rows[top] : win->lay->end;
 }
 
 static Input *
 inputnew(FILE *file)
 {
 	Input *in;
+	struct stat st;
+	ssize_t n;
+	size_t bomlen;
 
 	in = xmalloc(sizeof(*in));
 	in->file = file;
-	in->buflen = 0;
-	in->unread = RUNE_EOF;
+	in->spool = NULL;
+	in->pos = in->spoollen = 0;
+	in->spooleof = 0;
+	in->rawlen = in->buflen = in->bufpos = 0;
+	in->eof = 0;
+	in->attr = 0;
+	in->base = 0;
+	in->seekable = !fstat(fileno(file), &st) && S_ISREG(st.st_mode) &&
+	               (in->base = lseek(fileno(file), 0, SEEK_CUR)) >= 0;
+
+	/* Sniff the encoding from the first block, which is then kept */
+	while (in->rawlen < 4) {
+		if ((n = inputread(in, in->raw + in->rawlen, sizeof(in->raw) - in->rawlen)) == 0) {
+			in->eof = 1;
+			break;
+		}
+		in->rawlen += n;
+	}
+	in->enc = sniffencoding(in->raw, in->rawlen, &bomlen);
+	in->binary = (in->enc == ENC_UTF8 || in->enc == ENC_LATIN1) &&
+	             memchr(in->raw, '\0', in->rawlen);
+
+	/*
+	 * Binary input is shown as a hex dump, which needs random access. If
+	 * the input can't provide that, everything read from it goes through
+	 * a temporary file.
+	 */
+	if (in->binary && !in->seekable) {
+		if (!(in->spool = tmpfile()))
+			die(1, "tmpfile");
+		if (in->rawlen > 0 && pwrite(fileno(in->spool), in->raw, in->rawlen, 0) != (ssize_t)in->rawlen)
+			die(1, "write");
+		in->pos = in->spoollen = in->rawlen;
+		in->spooleof = in->eof;
+	}
+	memmove(in->raw, in->raw + bomlen, in->rawlen - bomlen);
+	in->rawlen -= bomlen;
 	return in;
 }
 
-static void
-inputfree(Input *in)
+static void
+inputfree(Input *in)
+{
+	if (in->spool)
+		fclose(in->spool);
+	fclose(in->file);
+	free(in);
+}
+
+static int
+inputatend(Input *in)
+{
+	return in->bufpos == in->buflen && in->rawlen == 0 && in->eof;
+}
+
+static int
+inputfill(Input *in)
+{
+	ssize_t n;
+	size_t used;
+
+	memmove(in->buf, in->buf + in->bufpos, in->buflen - in->bufpos);
+	in->buflen -= in->bufpos;
+	in->bufpos = 0;
+
+	/* UTF-8 needs no transcoding, so it is read straight into buf */
+	if (in->enc == ENC_UTF8 && in->rawlen > 0) {
+		memcpy(in->buf + in->buflen, in->raw, in->rawlen);
+		in->buflen += in->rawlen;
+		in->rawlen = 0;
+		return 0;
+	} else if (in->enc == ENC_UTF8) {
+		if (in->eof)
+			return 1;
+		if ((n = inputread(in, in->buf + in->buflen, BUFSIZ)) == 0)
+			in->eof = 1;
+		in->buflen += n;
+		return n == 0;
+	}
+
+	if (!in->eof) {
+		if ((n = inputread(in, in->raw + in->rawlen, sizeof(in->raw) - in->rawlen)) == 0)
+			in->eof = 1;
+		in->rawlen += n;
+	}
+	if (in->rawlen == 0)
+		return 1;
+
+	if (in->enc == ENC_LATIN1) {
+		in->buflen += latin1toutf8(in->buf + in->buflen, in->raw, in->rawlen);
+		used = in->rawlen;
+	} else {
+		in->buflen += utf16toutf8(in->buf + in->buflen, in->raw, in->rawlen,
+		                          in->enc == ENC_UTF16BE, &used);
+		if (used == 0 && in->eof) {
+			/* A dangling odd byte or lone high surrogate at the end */
+			in->buflen += utfencode(in->buf + in->buflen, RUNE_INVALID);
+			used = in->rawlen;
+		}
+	}
+	memmove(in->raw, in->raw + used, in->rawlen - used);
+	in->rawlen -= used;
+	return 0;
+}
+
+static ssize_t
+inputpull(Input *in)
+{
+	char buf[BUFSIZ];
+	ssize_t n;
+
+	while ((n = read(fileno(in->file), buf, sizeof(buf))) < 0)
+		if (errno != EINTR)
+			die(1, "read");
+	if (n == 0)
+		in->spooleof = 1;
+	else if (pwrite(fileno(in->spool), buf, n, in->spoollen) != n)
+		die(1, "write");
+	in->spoollen += n;
+	return n;
+}
+
+static ssize_t
+inputread(Input *in, char *buf, size_t len)
+{
+	ssize_t n;
+
+	if (!in->spool) {
+		while ((n = read(fileno(in->file), buf, len)) < 0)
+			if (errno != EINTR)
+				die(1, "read");
+		return n;
+	}
+
+	if (in->pos == in->spoollen && (in->spooleof || inputpull(in) == 0))
+		return 0;
+	n = inputreadat(in, in->pos, buf, len);
+	in->pos += n;
+	return n;
+}
+
+static size_t
+inputreadat(Input *in, off_t off, char *buf, size_t len)
+{
+	ssize_t n;
+
+	if (in->spool) {
+		while (in->spoollen < off + (off_t)len && !in->spooleof)
+			inputpull(in);
+		if (off >= in->spoollen)
+			return 0;
+		len = MIN(len, (size_t)(in->spoollen - off));
+		n = pread(fileno(in->spool), buf, len, off);
+	} else if (in->seekable) {
+		n = pread(fileno(in->file), buf, len, in->base + off);
+	} else {
+		return 0;
+	}
+	if (n < 0)
+		die(1, "read");
+	return n;
+}
+
+static off_t
+inputsize(Input *in)
+{
+	struct stat st;
+
+	if (in->spool) {
+		while (!in->spooleof)
+			inputpull(in);
+		return in->spoollen;
+	} else if (in->seekable && !fstat(fileno(in->file), &st)) {
+		return st.st_size - in->base;
+	}
+	return 0;
+}
+
+/* Returns whether a rune can be had without reading more input */
+static int
+inputbuffered(Input *in)
 {
-	fclose(in->file);
-	free(in);
+	return in->bufpos < in->buflen &&
+	       utfpeeklen(in->buf[in->bufpos]) <= in->buflen - in->bufpos;
 }
 
+/* Reports whether more of the input can be read without waiting for it */
 static int
-inputatend(Input *in)
+inputready(Input *in)
 {
-	return in->buflen == 0 && in->unread == RUNE_EOF && (feof(in->file) || ferror(in->file));
+	struct timeval now;
+	fd_set fds;
+
+	if (in->seekable || in->eof || inputbuffered(in) || (in->spool && in->pos < in->spoollen))
+		return 1;
+	now.tv_sec = now.tv_usec = 0;
+	FD_ZERO(&fds);
+	FD_SET(fileno(in->file), &fds);
+	return select(fileno(in->file) + 1, &fds, NULL, NULL, &now) > 0;
 }
 
 static Rune
-inputgetrune(Input *in)
+inputdecode(Input *in)
 {
-	size_t i, len;
-	int c;
+	size_t len;
 	Rune r;
 
-	if (in->unread != RUNE_EOF) {
-		r = in->unread;
-		in->unread = RUNE_EOF;
-		return r;
-	}
-
-	for (; in->buflen < LEN(in->buf); i++)
-		if ((c = fgetc(in->file)) != EOF)
-			in->buf[in->buflen++] = c;
-		else
+	while (in->buflen - in->bufpos < 4 && (in->bufpos == in->buflen ||
+	       utfpeeklen(in->buf[in->bufpos]) > in->buflen - in->bufpos))
+		if (inputfill(in))
 			break;
 
-	if (in->buflen == 0)
+	if (in->bufpos == in->buflen)
 		return RUNE_EOF;
 
-	len = utfdecode(in->buf, in->buflen, &r);
-	for (i = len; i < in->buflen; i++)
-		in->buf[i - len] = in->buf[i];
-	in->buflen -= len;
+	len = utfdecode(in->buf + in->bufpos, in->buflen - in->bufpos, &r);
+	in->bufpos += len;
 	return r;
 }
 
-static void
-inputungetrune(Input *in, Rune r)
+static Rune
+inputgetrune(Input *in)
 {
-	in->unread = r;
+	int params[16];
+	size_t nparams;
+	Rune r;
+
+	/*
+	 * In raw colour mode, control sequences are consumed here, so they
+	 * never reach the buffer. Only SGR sequences have any effect: they
+	 * update the attributes of the runes that follow.
+	 */
+	while ((r = inputdecode(in)) == KEY_ESCAPE && rawcolour) {
+		if (in->bufpos == in->buflen)
+			inputfill(in);
+		if (in->bufpos == in->buflen || in->buf[in->bufpos] != '[')
+			break;
+		in->bufpos++;
+
+		nparams = 0;
+		params[0] = 0;
+		while ((r = inputdecode(in)) != RUNE_EOF && r >= 0x20 && r <= 0x3F)
+			if (r >= '0' && r <= '9') {
+				params[nparams] = params[nparams] * 10 + r - '0';
+				if (params[nparams] > 0xFFFF)
+					params[nparams] = 0xFFFF;
+			} else if ((r == ';' || r == ':') && nparams < LEN(params) - 1) {
+				params[++nparams] = 0;
+			}
+		if (r == 'm')
+			in->attr = sgrapply(in->attr, params, nparams + 1);
+		else if (r == RUNE_EOF)
+			return r;
+	}
+	return r;
 }
 
 static Prompt *
@@ -812,6 +4350,7 @@ promptnew(Rune prompt, int (*action)(Arg))
 	p->active = 0;
 	p->prompt = prompt;
 	p->action = action;
+	p->update = NULL;
 	return p;
 }
 
@@ -830,7 +4369,7 @@ promptputchar(Prompt *p, char c)
 
 	p->buf[p->buflen++] = c;
 	rlen = utfpeeklen(p->buf[0]);
-	if (rlen >= p->buflen) {
+	if (rlen <= p->buflen) {
 		rlen = utfdecode(p->buf, p->buflen, &r);
 		for (i = rlen; i < p->buflen; i++)
 			p->buf[i - rlen] = p->buf[i];
@@ -847,14 +4386,40 @@ promptputchar(Prompt *p, char c)
 	return RUNE_INCOMPLETE;
 }
 
+static char *
+promptutf8(Prompt *p, size_t *len)
+{
+	char *s;
+	size_t i;
+
+	s = xmalloc(4 * p->len + 1);
+	*len = 0;
+	for (i = 0; i < p->len; i++)
+		*len += utfencode(s + *len, p->text[i]);
+	s[*len] = '\0';
+	return s;
+}
+
 static void
 uiinit(void)
 {
 	struct sigaction sa;
+	sigset_t winchmask;
+	char buf[64], *cap;
+	size_t i;
 
 	if (!(tty = fopen("/dev/tty", "r")))
 		die(1, "no tty");
 
+	/*
+	 * SIGWINCH is blocked except while waiting for a key, so that one
+	 * can't slip in between checking for it and starting to wait.
+	 */
+	sigemptyset(&winchmask);
+	sigaddset(&winchmask, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &winchmask, &waitmask);
+	sigdelset(&waitmask, SIGWINCH);
+
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = 0;
 	sa.sa_handler = sigwinch;
@@ -864,43 +4429,285 @@ uiinit(void)
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 
+	/* Workers write to the pipe to wake the main thread up */
+	if (pipe(wakefd) || fcntl(wakefd[0], F_SETFL, O_NONBLOCK) ||
+	    fcntl(wakefd[1], F_SETFL, O_NONBLOCK))
+		die(1, "pipe");
+
 	tcgetattr(fileno(tty), &tsave);
 	atexit(uiteardown);
 	tcurr = tsave;
 	tcurr.c_lflag &= ~(ECHO | ICANON);
 	tcsetattr(fileno(tty), TCSANOW, &tcurr);
 	setupterm(NULL, 1, NULL);
-	putp(tparm(cursor_invisible, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	putp(tparm(clear_screen, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	fflush(stdout);
+
+	/* Moving the cursor is common enough to be worth doing without tparm */
+	screen.fastgoto = HASCAP(cursor_address);
+	for (i = 0; i < 1000 && screen.fastgoto; i += 37) {
+		sprintgoto(buf, i, 2 * i);
+		cap = tparm(cursor_address, i, 2 * i, 0, 0, 0, 0, 0, 0, 0);
+		screen.fastgoto = cap && !strcmp(cap, buf);
+	}
+	uiputp(cursor_invisible);
+	uiwrite();
 }
 
 static void
 uiteardown(void)
 {
-	putp(tparm(cursor_normal, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	putchar('\n'); /* Make sure the cursor ends up on a new line */
+	uiputp(cursor_normal);
+	uiout("\n", 1); /* Make sure the cursor ends up on a new line */
+	uiwrite();
 	tcsetattr(fileno(tty), TCSANOW, &tsave);
-	fflush(stdout);
 }
 
+static void
+uierase(size_t row)
+{
+	size_t i;
+
+	for (i = 0; i < screen.cols; i++) {
+		screen.frame[row * screen.cols + i].r = ' ';
+		screen.frame[row * screen.cols + i].attr = 0;
+	}
+}
+
+/*
+ * Writes out the cells of the frame that have changed since the last time.
+ * Within a row, the cursor is moved past runs of unchanged cells that are
+ * longer than moving it would take, and trailing blanks are erased at once.
+ */
+static void
+uiflush(void)
+{
+	enum { MOVECOST = 8 };
+	Cell *f, *s;
+	Attr cur;
+	size_t i, y, x, n, first, last, blank, end;
+	char buf[4];
+	int move;
+
+	if (!screen.valid) {
+		uiputp(clear_screen);
+		for (i = 0; i < screen.rows * screen.cols; i++) {
+			screen.shown[i].r = ' ';
+			screen.shown[i].attr = 0;
+		}
+		screen.valid = 1;
+	} else {
+		uiscroll();
+	}
+
+#define SAME(i) (f[i].r == s[i].r && f[i].attr == s[i].attr)
+	cur = 0;
+	for (y = 0; y < screen.rows; y++) {
+		f = screen.frame + y * screen.cols;
+		s = screen.shown + y * screen.cols;
+		for (first = 0; first < screen.cols && SAME(first); first++)
+			;
+		if (first == screen.cols)
+			continue;
+		for (last = screen.cols; SAME(last - 1); last--)
+			;
+		for (blank = screen.cols; blank > first && f[blank - 1].r == ' ' && !f[blank - 1].attr; blank--)
+			;
+
+		end = MIN(last, blank);
+		for (move = 1, x = first; x < end; x++) {
+			for (n = x; n < end && SAME(n); n++)
+				;
+			if (n - x > MOVECOST) {
+				x = n - 1;
+				move = 1;
+				continue;
+			}
+			if (move)
+				uigoto(y, x);
+			move = 0;
+			uisetattr(cur, f[x].attr);
+			cur = f[x].attr;
+			uiout(buf, utfencode(buf, f[x].r));
+		}
+		if (last > blank) {
+			if (move)
+				uigoto(y, end);
+			uisetattr(cur, 0);
+			cur = 0;
+			uiputp(clr_eol);
+		}
+		memcpy(s, f, screen.cols * sizeof(*s));
+	}
+#undef SAME
+	uisetattr(cur, 0);
+	uiwrite();
+}
+
+/* Whether row a of the frame is the same as row b as shown */
 static int
-uigetkey(void)
+uirowsame(size_t a, size_t b)
 {
-	int c;
+	Cell *f, *s;
+	size_t i;
+
+	f = screen.frame + a * screen.cols;
+	s = screen.shown + b * screen.cols;
+	for (i = 0; i < screen.cols; i++)
+		if (f[i].r != s[i].r || f[i].attr != s[i].attr)
+			return 0;
+	return 1;
+}
 
-	errno = 0;
-	while ((c = fgetc(tty)) == EOF)
-		if (errno == EINTR) {
-			if (winch) {
-				winch = 0;
-				return KEY_RESIZE;
+/*
+ * Has the terminal scroll the rows of the window, when the frame is mostly
+ * what is shown moved up or down, so that uiflush only has to write the rows
+ * that come into view. The status line below the window is kept in place,
+ * with a scroll region if the terminal has them, or else by deleting and
+ * inserting lines.
+ */
+static void
+uiscroll(void)
+{
+	size_t n, k, y, same, best, most;
+	int up, bestup, region, lines;
+	Cell *top;
+
+	n = MIN(win->rows, screen.rows);
+	region = HASCAP(change_scroll_region);
+	lines = (HASCAP(delete_line) || HASCAP(parm_delete_line)) &&
+	        (HASCAP(insert_line) || HASCAP(parm_insert_line));
+	if (n < 2 || !(region || lines))
+		return;
+
+	for (most = y = 0; y < n; y++)
+		most += uirowsame(y, y);
+	best = 0;
+	bestup = 0;
+	for (k = 1; k < n && n - k > most; k++)
+		for (up = 0; up < 2; up++) {
+			if (region && !(up ? HASCAP(scroll_forward) || HASCAP(parm_index) :
+			    HASCAP(scroll_reverse) || HASCAP(parm_rindex)))
+				continue;
+			/* Moving the text up by k leaves row y showing row y + k */
+			for (same = y = 0; y < n - k; y++)
+				if (up ? uirowsame(y, y + k) : uirowsame(y + k, y))
+					same++;
+				else if (y == 0)
+					break;
+			if (same > most) {
+				most = same;
+				best = k;
+				bestup = up;
 			}
-		} else {
-			die(1, "could not get input key");
 		}
+	if (!best)
+		return;
 
-	return c;
+	k = best;
+	if (region) {
+		uiputp(tparm(change_scroll_region, 0, n - 1, 0, 0, 0, 0, 0, 0, 0));
+		uigoto(bestup ? n - 1 : 0, 0);
+		if (bestup)
+			uirepeat(parm_index, scroll_forward, k);
+		else
+			uirepeat(parm_rindex, scroll_reverse, k);
+		uiputp(tparm(change_scroll_region, 0, screen.rows - 1, 0, 0, 0, 0, 0, 0, 0));
+	} else {
+		uigoto(bestup ? 0 : n - k, 0);
+		uirepeat(parm_delete_line, delete_line, k);
+		uigoto(bestup ? n - k : 0, 0);
+		uirepeat(parm_insert_line, insert_line, k);
+	}
+
+	/* What is shown has moved the same way, with blank rows coming in */
+	top = screen.shown + (bestup ? 0 : k) * screen.cols;
+	memmove(top, screen.shown + (bestup ? k : 0) * screen.cols,
+	        (n - k) * screen.cols * sizeof(*top));
+	top = screen.shown + (bestup ? n - k : 0) * screen.cols;
+	for (y = 0; y < k * screen.cols; y++) {
+		top[y].r = ' ';
+		top[y].attr = 0;
+	}
+}
+
+/*
+ * Waits for a key. Progress made in the background is reported as KEY_WAKE,
+ * at most once every STATUSDELAY milliseconds. If idle is set, KEY_IDLE is
+ * returned instead of waiting when nothing else is due.
+ *
+ * Resizing the terminal tends to send a burst of SIGWINCH. Rather than
+ * reflowing for each of them, KEY_RESIZE is only returned once no more have
+ * arrived for RESIZEDELAY milliseconds, or as soon as a key is pressed.
+ */
+static int
+uigetkey(int idle)
+{
+	static struct timespec shown;
+	static int woken;
+	struct timespec delay, left, now, *timeout;
+	fd_set fds;
+	unsigned char c;
+	char junk[64];
+	ssize_t n;
+	long ms;
+	int ready;
+
+	delay.tv_sec = RESIZEDELAY / 1000;
+	delay.tv_nsec = RESIZEDELAY % 1000 * 1000000L;
+	for (;;) {
+		timeout = winch ? &delay : NULL;
+		if (woken) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ms = (now.tv_sec - shown.tv_sec) * 1000 + (now.tv_nsec - shown.tv_nsec) / 1000000;
+			if (ms >= STATUSDELAY && !winch) {
+				woken = 0;
+				shown = now;
+				return KEY_WAKE;
+			}
+			ms = MAX(STATUSDELAY - ms, 0);
+			left.tv_sec = ms / 1000;
+			left.tv_nsec = ms % 1000 * 1000000L;
+			if (!winch)
+				timeout = &left;
+		}
+		if (idle && !winch) {
+			left.tv_sec = left.tv_nsec = 0;
+			timeout = &left;
+		}
+
+		FD_ZERO(&fds);
+		FD_SET(fileno(tty), &fds);
+		if (!woken)
+			FD_SET(wakefd[0], &fds);
+		errno = 0;
+		ready = pselect(MAX(fileno(tty), wakefd[0]) + 1, &fds, NULL, NULL, timeout, &waitmask);
+		if (ready < 0 && errno != EINTR)
+			die(1, "could not get input key");
+		else if (ready < 0)
+			continue;
+
+		if (ready > 0 && FD_ISSET(wakefd[0], &fds)) {
+			while (read(wakefd[0], junk, sizeof(junk)) > 0)
+				;
+			woken = 1;
+			if (--ready == 0)
+				continue;
+		}
+		if (winch) {
+			winch = 0;
+			return KEY_RESIZE;
+		}
+		if (ready == 0) {
+			if (idle)
+				return KEY_IDLE;
+			continue;
+		}
+		while ((n = read(fileno(tty), &c, 1)) < 0)
+			if (errno != EINTR)
+				die(1, "could not get input key");
+		if (n == 0)
+			die(1, "could not get input key");
+		return c;
+	}
 }
 
 static void
@@ -916,12 +4723,69 @@ uigetsize(size_t *rows, size_t *cols)
 		*cols = ws.ws_col;
 }
 
+/* Returns whether there is a key waiting to be read */
+static int
+uikeypending(void)
+{
+	struct timeval now;
+	fd_set fds;
+
+	now.tv_sec = now.tv_usec = 0;
+	FD_ZERO(&fds);
+	FD_SET(fileno(tty), &fds);
+	return select(fileno(tty) + 1, &fds, NULL, NULL, &now) > 0;
+}
+
+/* Moves the cursor of the terminal */
+static void
+uigoto(size_t y, size_t x)
+{
+	char buf[64];
+
+	if (screen.fastgoto)
+		uiout(buf, sprintgoto(buf, y, x));
+	else
+		uiputp(tparm(cursor_address, y, x, 0, 0, 0, 0, 0, 0, 0));
+}
+
+static void
+uimove(size_t y, size_t x)
+{
+	screen.y = y;
+	screen.x = x;
+}
+
+static void
+uiout(const char *s, size_t n)
+{
+	if (screen.outlen + n > screen.outcap) {
+		screen.outcap = MAX(2 * screen.outcap, screen.outlen + n);
+		screen.out = xrealloc(screen.out, screen.outcap);
+	}
+	memcpy(screen.out + screen.outlen, s, n);
+	screen.outlen += n;
+}
+
+/* Collects the output of tputs */
+static int
+uioutc(int c)
+{
+	char ch;
+
+	ch = c;
+	uiout(&ch, 1);
+	return c;
+}
+
+/* Draws r at the given column of the current row */
 static size_t
 uiprint(Rune r, size_t col)
 {
-	size_t i, rlen, w;
+	size_t i, w;
 	char buf[4];
+	Attr a;
 
+	screen.x = col;
 	if (r == '\n') {
 		return col;
 	} else if (r == '\t') {
@@ -929,17 +4793,20 @@ uiprint(Rune r, size_t col)
 		if (col + w >= win->cols)
 			w = win->cols - col - 1;
 		for (i = 0; i < w; i++)
-			putchar(' ');
+			uiput(' ');
 		return col + w;
 	}
 
-	if (iscntrl(r))
-		putp(tparm(enter_standout_mode, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	rlen = sprintrune(buf, r);
-	for (i = 0; i < rlen; i++)
-		putchar(buf[i]);
-	if (iscntrl(r))
-		putp(tparm(exit_standout_mode, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+	if (iscntrl(r)) {
+		a = screen.attr;
+		screen.attr |= ATTR_STANDOUT;
+		sprintrune(buf, r);
+		uiput(buf[0]);
+		uiput(buf[1]);
+		screen.attr = a;
+	} else {
+		uiput(r);
+	}
 
 	w = printwidth(r);
 	if (col + w > win->cols)
@@ -948,28 +4815,55 @@ uiprint(Rune r, size_t col)
 }
 
 static void
-uipromptkey(Prompt *p, char key)
+uipromptdraw(Prompt *p)
 {
-	Rune r;
+	char s[128];
+	size_t i, n;
+
+	uierase(win->rows - 1);
+	uimove(win->rows - 1, 0);
+	p->col = uiprint(p->prompt, 0);
+	for (i = 0; i < p->len; i++)
+		p->col = uiprint(p->text[i], p->col);
+
+	/* The count of matches so far goes at the right */
+	if (p == search && srch && p->len > 0) {
+		uistatus(s);
+		n = strlen(s);
+		if (p->col + n + 1 < win->cols) {
+			uimove(win->rows - 1, win->cols - n);
+			uiputs(s);
+		}
+	}
+}
 
+static void
+uipromptkey(Prompt *p, char key)
+{
 	if (key == KEY_RETURN) {
 		p->active = 0;
 		p->action((Arg){ 0 });
 	} else if (key == KEY_ESCAPE) {
 		p->len = p->col = 0;
 		p->active = 0;
-		uirefresh();
-	} else if (key == KEY_BACKSPACE) {
-		if (p->len > 0) {
-			p->col -= printwidth(--p->len);
-			printf("\b \b");
-			fflush(stdout);
-		}
+		if (p->update)
+			p->update((Arg){ 0 });
+		else
+			uirefresh();
 	} else {
-		r = promptputchar(p, key);
-		if (r != RUNE_INCOMPLETE) {
-			p->col = uiprint(r, p->col);
-			fflush(stdout);
+		if (key == KEY_BACKSPACE) {
+			if (p->len == 0)
+				return;
+			p->len--;
+		} else if (promptputchar(p, key) == RUNE_INCOMPLETE) {
+			return;
+		}
+		/* The update redraws the prompt along with everything else */
+		if (p->update) {
+			p->update((Arg){ 0 });
+		} else {
+			uipromptdraw(p);
+			uiflush();
 		}
 	}
 }
@@ -978,31 +4872,197 @@ static void
 uipromptopen(Prompt *p)
 {
 	p->len = 0;
-	putp(tparm(cursor_address, win->rows - 1, 0, 0, 0, 0, 0, 0, 0, 0));
-	p->col = uiprint(p->prompt, 0);
-	fflush(stdout);
 	p->active = 1;
+	uipromptdraw(p);
+	uiflush();
+}
+
+/* Returns the prompt being typed in, if any */
+static Prompt *
+uiprompt(void)
+{
+	if (search->active)
+		return search;
+	else if (filterprompt->active)
+		return filterprompt;
+	else if (keywordprompt->active)
+		return keywordprompt;
+	return NULL;
+}
+
+/* Draws r at the current position, unless that is off screen */
+static void
+uiput(Rune r)
+{
+	Cell *c;
+
+	if (screen.y < screen.rows && screen.x < screen.cols) {
+		c = &screen.frame[screen.y * screen.cols + screen.x];
+		c->r = r;
+		c->attr = screen.attr;
+	}
+	screen.x++;
+}
+
+static void
+uiputp(const char *cap)
+{
+	if (HASCAP(cap))
+		tputs(cap, 1, uioutc);
+}
+
+static void
+uiputs(const char *s)
+{
+	while (*s)
+		uiput((unsigned char)*s++);
 }
 
 static void
 uirefresh(void)
 {
-	size_t i, col, start;
-	Rune *line;
+	size_t i, j, k, m, n, col, off, end, next, x, w, nspans, nkw, hiend;
+	size_t *rows, *spans, *kw;
+	Prompt *p;
+	Attr b, base;
+	Rune r;
 
-	putp(tparm(clear_screen, 0, 0, 0, 0, 0, 0, 0, 0, 0));
-	start = win->row >= win->rows ? win->row - win->rows : 0;
-	if (win->row < win->rows)
-		win->row = MIN(win->rows, win->buf->len);
+	if (win->hex) {
+		uirefreshhex();
+		return;
+	}
 
-	for (i = start; i < win->row; i++) {
-		col = 0;
-		if (i != start)
-			printf("\r\n");
-		for (line = win->buf->lines[i]; *line != RUNE_EOF; line++)
-			col = uiprint(*line, col);
+	for (i = 0; i < screen.rows; i++)
+		uierase(i);
+	n = winrows(win, &rows, input);
+
+	/* Matches of the last search on screen are highlighted */
+	nspans = k = hiend = 0;
+	spans = kw = NULL;
+	if (srch && n > 0)
+		srchextend(srch, inputatend(input), rows[0]);
+
+	for (i = 0; i < n; i++) {
+		/* Rows only follow on from each other within the lines shown */
+		if (srch && (i == 0 || rows[2 * i] != rows[2 * i - 1])) {
+			for (j = i + 1; j < n && rows[2 * j] == rows[2 * j - 1]; j++)
+				;
+			free(spans);
+			nspans = srchspans(srch, rows[2 * i], rows[2 * j - 1], &spans);
+			k = hiend = 0;
+		}
+		col = x = 0;
+		uimove(i, 0);
+		off = rows[2 * i];
+		end = rows[2 * i + 1];
+		nkw = keywords ? kwspans(keywords, win->buf, off, end, &kw) : 0;
+		m = 0;
+		base = bufattr(win->buf, off, &next);
+		while (off < end) {
+			if (off == next)
+				base = bufattr(win->buf, off, &next);
+			for (; k < nspans && spans[2 * k] <= off; k++)
+				hiend = MAX(hiend, spans[2 * k + 1]);
+			for (; m < nkw && kw[3 * m + 1] <= off; m++)
+				;
+			b = base;
+			if (m < nkw && kw[3 * m] <= off)
+				b = ATTR_SETFG(b, keywordcolours[kw[3 * m + 2] % LEN(keywordcolours)] + 1) | ATTR_BOLD;
+			if (off < hiend)
+				b ^= MATCHATTR;
+			screen.attr = b;
+			off += utfdecode(win->buf->text + off, end - off, &r);
+			if (!chop) {
+				col = uiprint(r, col);
+				continue;
+			}
+
+			/* Only the columns from hoff on are shown */
+			w = r == '\t' ? nexttabstop(x) - x : r == '\n' ? 0 : printwidth(r);
+			if (x >= win->hoff + win->cols)
+				break;
+			if (x >= win->hoff && x + w <= win->hoff + win->cols) {
+				uiprint(r, x - win->hoff);
+			} else {
+				screen.x = MAX(x, win->hoff) - win->hoff;
+				for (j = MAX(x, win->hoff); j < MIN(x + w, win->hoff + win->cols); j++)
+					uiput(' ');
+			}
+			x += w;
+		}
+		screen.attr = 0;
+	}
+	free(spans);
+	free(rows);
+	if (status)
+		uistatusdraw();
+	if ((p = uiprompt()))
+		uipromptdraw(p);
+	uiflush();
+}
+
+static void
+uirefreshhex(void)
+{
+	unsigned char buf[16];
+	char s[32];
+	size_t i, j, n, rowlen;
+	off_t off;
+	Prompt *p;
+
+	for (i = 0; i < screen.rows; i++)
+		uierase(i);
+	rowlen = hexrowlen(win->cols);
+	for (i = 0; i < win->rows; i++) {
+		off = win->hexoff + (off_t)(i * rowlen);
+		if (!(n = inputreadat(input, off, (char *)buf, rowlen)))
+			break;
+		uimove(i, 0);
+		sprintf(s, "%08jx ", (uintmax_t)off);
+		uiputs(s);
+		for (j = 0; j < rowlen; j++) {
+			if (j < n)
+				sprintf(s, " %02x", buf[j]);
+			uiputs(j < n ? s : "   ");
+		}
+		uiputs("  |");
+		for (j = 0; j < n; j++)
+			uiput(buf[j] < 0x80 && isprint(buf[j]) ? buf[j] : '.');
+		uiput('|');
+	}
+	if ((p = uiprompt()))
+		uipromptdraw(p);
+	uiflush();
+}
+
+/* Sends a capability taking a count, or else the one without n times */
+static void
+uirepeat(const char *parm, const char *one, size_t n)
+{
+	if (HASCAP(parm) && (n > 1 || !HASCAP(one)))
+		uiputp(tparm((char *)parm, n, 0, 0, 0, 0, 0, 0, 0, 0));
+	else
+		while (n--)
+			uiputp(one);
+}
+
+/* Standout is separate from SGR, and turning it off may reset everything */
+static void
+uisetattr(Attr from, Attr to)
+{
+	char buf[64];
+	size_t n;
+
+	if ((from & ATTR_STANDOUT) && !(to & ATTR_STANDOUT)) {
+		uiputp(exit_standout_mode);
+		if ((n = sgrdiff(buf, 0, to)) > 0)
+			uiout(buf, n);
+	} else {
+		if ((n = sgrdiff(buf, from & ~(Attr)ATTR_STANDOUT, to & ~(Attr)ATTR_STANDOUT)) > 0)
+			uiout(buf, n);
+		if (!(from & ATTR_STANDOUT) && (to & ATTR_STANDOUT))
+			uiputp(enter_standout_mode);
 	}
-	fflush(stdout);
 }
 
 static void
@@ -1011,10 +5071,134 @@ uiresize(void)
 	size_t rows, cols;
 
 	uigetsize(&rows, &cols);
-	winresize(win, rows, cols, input);
+	uisetsize(rows, cols);
+	if (rows < 2)
+		status = 0;
+	winresize(win, rows - status, cols, input);
 	uirefresh();
 }
 
+/*
+ * Reads ahead while there is nothing else to do, so that the matches of the
+ * last search can be counted in the whole input, and the index built
+ */
+static void
+uireadahead(void)
+{
+	enum { READAHEAD = 1 << 22 };
+	size_t end;
+
+	for (end = win->buf->textlen + READAHEAD; win->buf->textlen < end && inputready(input);)
+		if (bufread(win->buf, input))
+			break;
+	if (textindex)
+		idxextend(textindex, inputatend(input));
+	if (!srch)
+		return;
+	srchextend(srch, inputatend(input), srch->cur != SIZE_MAX ? srch->cur : win->anchor);
+	/* The count may be complete now without any more work to wake us */
+	if (inputatend(input)) {
+		uistatusdraw();
+		uiflush();
+	}
+}
+
+/* Sizes the screen to the terminal, which is cleared on the next flush */
+static void
+uisetsize(size_t rows, size_t cols)
+{
+	size_t i;
+
+	screen.rows = rows;
+	screen.cols = cols;
+	screen.frame = xrealloc(screen.frame, MAX(rows * cols, 1) * sizeof(*screen.frame));
+	screen.shown = xrealloc(screen.shown, MAX(rows * cols, 1) * sizeof(*screen.shown));
+	for (i = 0; i < rows; i++)
+		uierase(i);
+	screen.valid = 0;
+}
+
+/* Shows or hides the status line, which takes the last row from the window */
+static void
+uisetstatus(int on)
+{
+	if (on == status || (on && win->rows < 2))
+		return;
+	status = on;
+	winresize(win, on ? win->rows - 1 : win->rows + 1, win->cols, input);
+}
+
+/* Describes how many matches the last search has, and which is on screen */
+static void
+uistatus(char *s)
+{
+	char nth[32], total[32];
+	size_t n, m;
+	int done;
+
+	done = srchcount(srch, srch->cur, &m, &n) && inputatend(input);
+	sprintcount(total, m);
+	if (done && m == 0)
+		strcpy(s, "pattern not found");
+	else if (srch->cur == SIZE_MAX)
+		sprintf(s, "%s match%s", total, m == 1 ? "" : "es");
+	else if (n == SIZE_MAX)
+		sprintf(s, "match ? of %s", total);
+	else {
+		sprintcount(nth, n);
+		sprintf(s, "match %s of %s", nth, total);
+	}
+	if (!done)
+		strcat(s, " so far");
+}
+
+/*
+ * Draws the count of matches, on the status line or in the prompt, leaving it
+ * to the caller to flush
+ */
+static void
+uistatusdraw(void)
+{
+	char s[128];
+
+	if (!srch)
+		return;
+	if (search->active) {
+		uipromptdraw(search);
+		return;
+	} else if (!status) {
+		return;
+	}
+	uistatus(s);
+	uierase(win->rows);
+	uimove(win->rows, 0);
+	uiputs(s);
+}
+
+/* Writes out everything gathered since the last time */
+static void
+uiwrite(void)
+{
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < screen.outlen; off += n)
+		if ((n = write(STDOUT_FILENO, screen.out + off, screen.outlen - off)) < 0) {
+			if (errno != EINTR)
+				break;
+			n = 0;
+		}
+	screen.outlen = 0;
+}
+
+/* Wakes the main thread up from uigetkey; this is safe to call from workers */
+static void
+uiwake(void)
+{
+	while (write(wakefd[1], "", 1) < 0 && errno == EINTR)
+		;
+}
+
 static void
 sigterm(int signo)
 {
@@ -1032,42 +5216,88 @@ sigwinch(int signo)
 int
 main(int argc, char **argv)
 {
-	int key;
+	Prompt *p;
+	int key, opt, ahead;
 	size_t i, rows, cols;
 	FILE *file;
 
-	if (argc == 1) {
+	while ((opt = getopt(argc, argv, "iIRSt")) != -1)
+		switch (opt) {
+		case 'i':
+			casemode = CASE_SMART;
+			break;
+		case 'I':
+			casemode = CASE_IGNORE;
+			break;
+		case 'R':
+			rawcolour = 1;
+			break;
+		case 'S':
+			chop = 1;
+			break;
+		case 't':
+			indexing = 1;
+			break;
+		default:
+			die(2, "usage: spg [-iIRSt] [file]");
+		}
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0) {
 		file = stdin;
-	} else if (argc == 2) {
-		if (!(file = fopen(argv[1], "r")))
-			die(1, "cannot open '%s'", argv[1]);
+	} else if (argc == 1) {
+		if (!(file = fopen(argv[0], "r")))
+			die(1, "cannot open '%s'", argv[0]);
 	} else {
-		die(2, "usage: spg [file]");
+		die(2, "usage: spg [-iIRSt] [file]");
 	}
 
 	if (isatty(fileno(file)))
 		die(1, "input is a tty; provide input via file argument or pipe");
 	uiinit();
+	scaninit();
 	input = inputnew(file);
 	uigetsize(&rows, &cols);
 	win = winnew(rows, cols);
 	search = promptnew('/', searchforwards);
+	filterprompt = promptnew('&', filtersubmit);
+	keywordprompt = promptnew('*', keywordsubmit);
+	win->hex = input->binary;
+	if (indexing && !win->hex)
+		textindex = idxnew(win->buf);
 	uiresize();
 
 	for (;;) {
-		key = uigetkey();
+		if (textindex)
+			idxextend(textindex, inputatend(input));
+		/* While a prompt is open, only the text read so far is searched */
+		ahead = !uiprompt() && ((srch && status) || textindex) &&
+		        !inputatend(input) && inputready(input);
+		key = uigetkey((((srch && (status || search->active)) || textindex) &&
+		                poolqueued()) || ahead);
 		if (key == KEY_RESIZE) {
 			uiresize();
 			continue;
+		} else if (key == KEY_WAKE) {
+			uistatusdraw();
+			uiflush();
+			continue;
+		} else if (key == KEY_IDLE) {
+			if (!poolstep() && !uiprompt())
+				uireadahead();
+			continue;
 		}
 
-		if (search->active) {
-			uipromptkey(search, key);
+		if ((p = uiprompt())) {
+			uipromptkey(p, key);
 			continue;
 		}
 
 		for (i = 0; i < LEN(keys); i++)
 			if (keys[i].key == key) {
+				if (keys[i].func != searchforwards && keys[i].func != searchbackwards)
+					uisetstatus(0);
 				if (keys[i].func(keys[i].arg))
 					goto done;
 				break;
@@ -1076,6 +5306,14 @@ main(int argc, char **argv)
 
 done:
 	promptfree(search);
+	promptfree(filterprompt);
+	promptfree(keywordprompt);
+	if (srch)
+		srchfree(srch);
+	if (keywords)
+		kwfree(keywords);
+	if (textindex)
+		idxfree(textindex);
 	winfree(win);
 	inputfree(input);
 	return 0;